@@ -44,7 +44,9 @@
  *  
  *  While using an extra pointer in each call to a new function slow down
  *  the code, it gets compensated by the fact that there will be no need to
- *  check for errors at the return of the called function.
+ *  check for errors at the return of the called function. When even that
+ *  pointer is not wanted, ctrans_current() and the ctrans_current_* 
+ *  variants find the innermost transaction of the running thread.
  *
  *  Next is a draft diagram showing the difference. In both case function4, placed
  *  5 levels down the stack can return/raise an error/exception.
@@ -102,6 +104,13 @@
  *  function transaction_stop is executed when we programatically indicate the end of transaction using ENDTRANSACTION.<br>
  *  function exception_captured is executed when we programatically raise an exception.<br>
  *
+ *  NEWTRANSACTION_FULL takes an extra flags argument. Transactions doing many small
+ *  allocations should use CTRANS_ALLOC_ARENA so that ctrans_try_malloc is served from
+ *  a region owned by the transaction and freed all at once:
+ *  <pre>
+ *    NEWTRANSACTION_FULL(ptrTrans, transaction_start, transaction_stop, exception_captured, "Transaction Name", CTRANS_ALLOC_ARENA);
+ *  </pre>
+ *
  *  Each NEWTRANSACTION(ptrTrans) must be matched with its partner:
  *  <pre>
  *       ENDTRANSACTION(ptrTrans);
@@ -120,19 +129,21 @@
  *  The second argument (type) is defined for recipient exceptions and must be one of:
  *  typedef enum { USER=1100000, ADMIN=1200000, IMPLEMENTATION=1300000 } recipEx_type;
  *
- *  The second argument is any integer. At this moment (April 2010) no standard sender exception are defined.<br>
- *  Any sensible integer value can be used. <b>Nevertheless use any custom integer in the range 2000000-3000000</b><br>.
- *  Maybe it can make sense in a future to have standard type for common scenarios. For example, something like:
+ *  For sender exceptions the second argument is any integer. <b>Use any custom integer in the range 2000000-3000000</b>
+ *  or'ed with the standard exception classes of senderEx_type (they take the high bits of the type):
  *  <pre>
- *  typedef enum { IOEXCEPTION=1<<1, TIMEOUT=1<<2, NO_RESOURCE_AVAILABLE=1<<3, ... } senderEx_type; <br>
+ *  typedef enum { IOEXCEPTION=1<<24, TIMEOUT=1<<25, NO_RESOURCE_AVAILABLE=1<<26, ... } senderEx_type; <br>
  *  </pre>
- *  Where the final exception could be the masked sum of standard exception plus maybe a custom integer like:<br>
+ *  Where the final exception is the masked sum of standard exception plus maybe a custom integer like:<br>
  *  <pre>
- *  IOEXCEPTION || NO_RESOURCE_AVAILABLE
+ *  IOEXCEPTION | NO_RESOURCE_AVAILABLE | 2000042
  *  </pre>
  *  From the author point of view that will make exceptions more intuitive and useful to handle than 
  *  the typed exceptions of Java or completly non-typed exceptions in other languages. All this without dropping the
  *  speed of pure C.<br>
+ *  Instead of branching on the type inside exception_captured, a CtransHandlerTable maps each class to a handler.
+ *  It is built once and attached to any number of transactions (ctrans_set_handler_table). A handler can even 
+ *  resume execution after the raise, without rolling back the transaction.
  *
  *  The code will continue executing in the line below ENDTRANSACTION once transaction_stop or exception_captured are finished.
  *  That can look anoying in theory but it's not in practice. Just take a look at examples test*.c. The squema next sows
@@ -175,11 +186,26 @@
  *  makes a hidden jump to a tag defined in ENDTRANSACTION so extrange compiler errors would arise.
  *  </li>
  *  <li>
+ *  Transactions can be nested with NEWCHILDTRANSACTION. Inside a transaction a savepoint (NEWSAVEPOINT) allows 
+ *  to retry a step: an exception raised while it's active just releases what the step acquired.
+ *  </li>
+ *  <li>
+ *  By default the function containing NEWTRANSACTION must still be running when ENDTRANSACTION is reached or an
+ *  exception is raised (as with any setjmp/longjmp). A transaction started in one callback and ended in another
+ *  one should be a long-lived transaction (NEWLONGTRANSACTION, RESUMETRANSACTION, SUSPENDTRANSACTION, see
+ *  test3.c). NEWTRANSACTION_FULL(..., CTRANS_STACK_SNAPSHOT) is still supported but copies the stack at each phase.
+ *  </li>
+ *  <li>
  *  Ussually a function transaction_end will be used and called both in transaction_stop/exception_captured. That function will
  *  play a similar role to the "finally" code in the try-catch-finally Java syntax. It defines common code for cases
  *  that do/do-not raise an exception.
  *  </li>
  *
+ *  <h1>Tracing</h1>
+ *  When built with <sys/sdt.h> available the library carries static tracepoints (provider libctrans)
+ *  at the start, commit, raise and end of every transaction and at each ctrans_try_malloc. They cost
+ *  nothing until perf or bpftrace attach to them. The list of probes is in libctrans.c.
+ *
  *  For the impacients, <a href="./files.html">test*.c</a> provide example code of its use in code.
  */
 
@@ -193,6 +219,23 @@
 #define __CTRANSACTIONS__
 
 
+/*
+ * Message catalog (ctrans_message_register). An exception raised with
+ * a message keeps up to CTRANS_MESSAGE_ARGS arguments and is formatted
+ * only when asked to (ctrans_format_exception).
+ */
+#define CTRANS_MESSAGE_ARGS 6
+#define CTRANS_MESSAGES_MAX 4096
+
+typedef guint32 CtransMessageId; // 0: no message
+
+typedef union {
+    gint64        i;
+    guint64       u;
+    gdouble       d;
+    gconstpointer p;
+} CtransMessageArg;
+
 /**
  * @brief It's used as a parent class for sender/recipient exceptions.<br>
  * When a new exception is thrown the current transaction aborts and
@@ -201,6 +244,8 @@
  * An union is used to implement child classes.
  * At this moment (2010-03) only the type, and *i18n are used.
  * Other members must be ignored.
+ * The texts of an exception raised with ctrans_raise_message are NULL
+ * until ctrans_format_exception.
  */
 typedef struct {  
     guint32                           type;
@@ -210,6 +255,8 @@ typedef struct {
     GThread*                          gthread;
     char*                             description_i18n;
     char*                             detail_i18n;
+    CtransMessageId                   message;  // catalog entry, 0 if raised with its texts
+    CtransMessageArg                  args[CTRANS_MESSAGE_ARGS]; // of message
 } exception_base;
 
 /**
@@ -260,46 +307,501 @@ typedef struct {
 #define TRANS_START        0
 #define TRANS_STOP         1
 #define EXCEPTION_CAPTURED 2
+#define TRANS_RESTART      3 // ctrans_restart_transaction: FUN_START and the body run again
+
+/*
+ * Flags accepted by NEWTRANSACTION_FULL / ctrans_new_transaction_full.
+ * They can be or'ed together.
+ */
+#define CTRANS_DEFAULT     0
+#define CTRANS_ALLOC_ARENA (1<<0) // ctrans_try_malloc serves memory from a per-transaction region
+#define CTRANS_STACK_SNAPSHOT (1<<1) // copy the stack at start so ENDTRANSACTION can run from another callback
+#define CTRANS_LONG_LIVED  (1<<2) // set by NEWLONGTRANSACTION: the transaction spans several callbacks
+#define CTRANS_HUGE_PAGES  (1<<3) // ask for transparent huge pages for the large blocks
+#define CTRANS_WARM_ARENA  (1<<4) // CTRANS_ALLOC_ARENA keeping the chunks for the next transaction of the same name
 
+/*
+ * Region (bump) allocator tuning. Each chunk of the arena is
+ * CTRANS_ARENA_CHUNK_SIZE bytes (header included) unless a single request
+ * is bigger, in which case a dedicated chunk is allocated for it.
+ * Every block returned is aligned to CTRANS_ARENA_ALIGN bytes.
+ */
+#define CTRANS_ARENA_CHUNK_SIZE 8192
+#define CTRANS_ARENA_ALIGN      16
 
+typedef struct _CtransArenaChunk CtransArenaChunk;
+typedef struct _CtransWarmArena CtransWarmArena;
 
+/*
+ * With CTRANS_WARM_ARENA the chunks of a finished transaction stay in
+ * its thread, up to CTRANS_WARM_ARENA_MAX bytes per sDebug, and the
+ * next transaction with the same name reuses them instead of calling
+ * malloc. Names not started for CTRANS_WARM_ARENA_IDLE microseconds
+ * give their chunks back (checked while the thread keeps starting
+ * warm transactions, or with ctrans_warm_arena_trim).
+ */
+#define CTRANS_WARM_ARENA_MAX   (256*1024)
+#define CTRANS_WARM_ARENA_IDLE  (10*G_USEC_PER_SEC)
+
+/*
+ * Blocks of CTRANS_MMAP_THRESHOLD bytes or more (in any mode) get their
+ * own anonymous mapping, returned to the system as soon as the block is
+ * released. Up to CTRANS_MMAP_CACHE mappings of at most
+ * CTRANS_MMAP_CACHE_MAX bytes are kept per thread for reuse, with their
+ * pages already given back (MADV_DONTNEED). With CTRANS_HUGE_PAGES,
+ * mappings of CTRANS_HUGE_PAGE_SIZE or more are advised MADV_HUGEPAGE.
+ */
+#define CTRANS_MMAP_THRESHOLD   (256*1024)
+#define CTRANS_MMAP_CACHE       4
+#define CTRANS_MMAP_CACHE_MAX   (64*1024*1024)
+#define CTRANS_HUGE_PAGE_SIZE   (2*1024*1024)
+
+/*
+ * Headers placed in front of the blocks returned by ctrans_try_malloc
+ * and the other ctrans allocators (private to libctrans.c).
+ */
+typedef struct _CtransBlock CtransBlock;
+typedef struct _CtransHeapBlock CtransHeapBlock;
+
+/*
+ * Maximum number of finished transactions kept per thread for reuse.
+ */
+#define CTRANS_POOL_SIZE        32
+
+/*
+ * Size of the per-thread stack used to restore CTRANS_STACK_SNAPSHOT
+ * snapshots when a transaction ends or an exception is raised.
+ *
+ * The restore ends with a longjmp from that stack (heap memory) to the
+ * thread stack. Built with _FORTIFY_SOURCE, glibc checks it in
+ * __longjmp_chk and aborts ("longjmp causes uninitialized stack frame")
+ * if the side stack lies above the thread stack in memory. It works
+ * where the heap is below the stacks (usual Linux layout), but build
+ * libctrans.c without _FORTIFY_SOURCE if snapshots are used elsewhere.
+ */
+#define CTRANS_SIDE_STACK_SIZE  (64*1024)
+
+/*
+ * Number of cleanups registered through ctrans_defer that are stored
+ * inside the Transaction itself. Only further ones need extra memory.
+ */
+#define CTRANS_DEFER_INLINE     8
+
+typedef void (*CtransCleanupFunc) (gpointer arg);
+
+typedef struct {
+    CtransCleanupFunc fn;
+    gpointer          arg;
+} CtransDeferred;
+
+
+typedef struct _Transaction Transaction;
+typedef struct _CtransHandlerTable CtransHandlerTable;
+
+typedef void (*CtransTransactionFunc) (Transaction* pTrans);
+
+/*
+ * Maximum number of prepare hooks of a transaction (see ctrans_on_prepare).
+ */
+#define CTRANS_PREPARE_HOOKS    4
+
+typedef void (*CtransPrepareFunc) (Transaction* pTrans, gpointer arg);
+
+typedef struct {
+    CtransPrepareFunc fn;
+    gpointer          arg;
+} CtransPrepareHook;
+
+/*
+ * Number of buckets of the statistics histograms. Bucket 0 counts the
+ * value 0, bucket i (i>0) values in [2^(i-1), 2^i). The last bucket
+ * also counts anything bigger.
+ */
+#define CTRANS_STATS_BUCKETS    32
+
+/*
+ * Only one transaction in CTRANS_STATS_TIMING_SAMPLE (per thread) is
+ * timed for the duration statistics.
+ */
+#define CTRANS_STATS_TIMING_SAMPLE 16
+
+/**
+ * @brief Counters kept by the library (see ctrans_stats_get).
+ *
+ * They are kept per thread and merged when read. Each counter is read
+ * atomically, but while other threads run transactions the counters of
+ * one result may come from slightly different moments. Building the library
+ * with -DCTRANS_NO_STATS compiles them out: the query functions then
+ * return zeros.
+ */
+typedef struct {
+    guint64 started;
+    guint64 committed;
+    guint64 rolled_back;         // aborted by an exception, or ended with their parent
+    guint64 savepoint_rollbacks;
+    guint64 restarts;            // re-executions after ctrans_restart_transaction
+    guint64 allocs;              // blocks returned by ctrans_try_malloc
+    guint64 frees;               // blocks given back early with ctrans_free
+    guint64 alloc_bytes;
+    guint64 timed;               // ended transactions that were timed (sampled)
+    guint64 duration_ns;         // sum over the timed transactions
+    guint64 duration_hist[CTRANS_STATS_BUCKETS];     // nanoseconds, timed transactions
+    guint64 stack_backup_hist[CTRANS_STATS_BUCKETS]; // bytes copied by CTRANS_STACK_SNAPSHOT
+} CtransStats;
+
+typedef void (*CtransStatsFunc) (const gchar* sDebug, const CtransStats* stats, 
+    gpointer user_data);
+
+/**
+ * @brief Savepoint inside a running transaction.
+ *
+ * It records how far the transaction resources went when it was pushed
+ * (ctrans_savepoint_push or NEWSAVEPOINT). Rolling back to it releases
+ * only what was acquired afterwards: the arena is cut back to the
+ * recorded position, newer tracked blocks are freed and newer child
+ * transactions are ended. The savepoint is normally a local variable
+ * and must be released before its function returns.
+ */
+typedef struct _CtransSavepoint CtransSavepoint;
+
+struct _CtransSavepoint {
+    jmp_buf           jmpTarget;
+    CtransSavepoint*  prev;            // enclosing savepoint of the same transaction
+    gsize             block_seq;       // heap blocks with a bigger seq are newer
+    CtransArenaChunk* arena;
+    gsize             arena_used;
+    guint             n_deferred;
+    guint             last_child_id;   // children with a bigger id are newer
+    Transaction*      current;         // innermost transaction of the thread when pushed
+    gsize             bytes_used;
+    gsize             undo_used;
+};
 
 /**
  * @brief Represents a running transaction
  *
+ * When the transaction is created with CTRANS_ALLOC_ARENA, memory
+ * requested through ctrans_try_malloc is carved out of arena (a list
+ * of chunks, newest first) and allocated_memory stays empty. 
+ * Otherwise each block is tracked in allocated_memory (doubly linked
+ * through the block headers, newest first) so ctrans_free can unlink
+ * it in O(1). Blocks of CTRANS_MMAP_THRESHOLD bytes or more are always
+ * tracked there, each in its own mapping, even in arena mode.
  *
+ * Child transactions still running are linked from children (newest
+ * first) and are ended, with their resources, when the parent ends or
+ * is rolled back.
  */
+
 struct _Transaction {
     uint     id;
+    guint    flags;
     guint32* stack_ptr2Top;
     guint32* stack_backup;
-    guint    stack_size;
+    gsize    stack_size;
+    gsize    stack_capacity; // words allocated for stack_backup (kept when recycled)
     jmp_buf  transStart;
     gchar*   sDebug; // free use for debugging purposes
-    GList*   child_transactions ;
-    GList*   allocated_memory   ;
-    // Other possible transaction resources:
- // GList*   allocated_sockets  ;  ?  // TODO(1)
- // GList*   allocated_threads  ;  ?  // TODO(1)
- // GList*   allocated_timers   ;  ?  // TODO(1)
- // GList*   allocated_listeners;  ?  // TODO(1)
-    exception_base* raisedException;
+    gsize    sDebug_capacity;
+    Transaction* parent         ;
+    Transaction* children       ; // running child transactions, newest first
+    Transaction* next_sibling   ;
+    CtransSavepoint* savepoint  ; // innermost active savepoint
+    CtransHeapBlock* allocated_memory; // newest block first
+    gsize    last_block_seq     ;
+    CtransArenaChunk* arena     ; // current chunk. Older ones are linked from it
+    CtransWarmArena*  warm      ; // chunks kept for the transactions of sDebug (CTRANS_WARM_ARENA)
+    // Any other resource (sockets, threads, timers, listeners, ...) 
+    // is released by a cleanup registered with ctrans_defer.
+    CtransDeferred  deferred_inline[CTRANS_DEFER_INLINE];
+    CtransDeferred* deferred_overflow; // entries after the inline ones (kept when recycled)
+    guint           deferred_capacity; // entries allocated in deferred_overflow
+    guint           n_deferred;
+    guint8*         undo_log;      // see ctrans_undo_save (kept when recycled)
+    gsize           undo_used;
+    gsize           undo_capacity;
+    CtransPrepareHook prepare[CTRANS_PREPARE_HOOKS];
+    guint           n_prepare;
+    gpointer        stm;           // state of libctrans_stm.c while the transaction uses it
+    exception_base* raisedException; // points to exception once raised
+    recipient_exception exception;   // storage for the last exception raised on the transaction
+    gchar*          exception_text;  // texts copied by ctrans_raise_copy (kept when recycled)
+    CtransHandlerTable* handlers;    // shared, may be NULL
+    Transaction*    next_free; // link in the per-thread pool of finished transactions
+    Transaction*    prev_current; // enclosing active transaction in the same thread
+    // Long-lived transactions only (see NEWLONGTRANSACTION)
+    CtransTransactionFunc fun_stop;
+    CtransTransactionFunc fun_exc;
+    gboolean        resumed; // between RESUMETRANSACTION and SUSPENDTRANSACTION
+    // Statistics
+    CtransStats*    stats_name;  // counters of sDebug, in the shard of the starting thread
+    gpointer        stats_shard; // that shard: other threads count in their own
+    gint64          start_ns;
+    // Memory budget (see ctrans_set_budget)
+    gsize           bytes_used;    // requested through ctrans_try_malloc and not released
+    gsize           byte_budget;   // 0 means no limit
+    gboolean        budget_global; // bytes_used is also counted in the process-wide budget
 };
 
-typedef struct _Transaction Transaction;
-
 gint       ctrans_new_transaction (guint32* stack_ptr2Top, Transaction** ppTrans, 
                Transaction* pParentTrans, gchar* sDebug) ;
+/** @brief Same as ctrans_new_transaction but accepting CTRANS_* creation flags.
+ *
+ * The jump target is not set here: the caller (NEWTRANSACTION) must
+ * setjmp((*ppTrans)->transStart) right after this function returns, so
+ * the target lives in the caller frame. TRANS_START is always returned.
+ *
+ * \param flags CTRANS_DEFAULT or an or'ed combination of CTRANS_* flags.
+ *     With CTRANS_ALLOC_ARENA every ctrans_try_malloc is a pointer bump
+ *     inside the transaction region and the whole region is released in
+ *     one step when the transaction ends or is rolled back.
+ *     CTRANS_WARM_ARENA does the same but the chunks are kept by the
+ *     thread and reused by the next transaction with the same sDebug.
+ *     With CTRANS_STACK_SNAPSHOT the stack between stack_ptr2Top and the
+ *     current frame is copied, and restored before jumping back. Only
+ *     needed when ENDTRANSACTION (or a raise) runs once the function that
+ *     executed NEWTRANSACTION has returned (see test3.c). Without it start
+ *     and end of a transaction cost the same regardless of the stack depth.
+ */
+gint       ctrans_new_transaction_full (guint32* stack_ptr2Top, Transaction** ppTrans, 
+               Transaction* pParentTrans, gchar* sDebug, guint flags) ;
+/** @brief Creates a long-lived transaction. See NEWLONGTRANSACTION.
+ *
+ * Everything the transaction owns lives on the heap, nothing is
+ * saved from the stack, so it can be resumed, committed or aborted
+ * from any later callback of the main loop. It's left suspended:
+ * it's not the current transaction of the thread.
+ * \param fun_stop called when the transaction commits.
+ * \param fun_exc  called when an exception aborts it.
+ */
+void       ctrans_new_long_transaction (Transaction** ppTrans, gchar* sDebug, guint flags, 
+               CtransTransactionFunc fun_stop, CtransTransactionFunc fun_exc) ;
+/** @brief Makes a long-lived transaction the current one of the thread.
+ *
+ * The jump target must be set right after (RESUMETRANSACTION does both).
+ */
+void       ctrans_resume_transaction (Transaction* pTrans) ;
+/** @brief Undoes ctrans_resume_transaction. Resources are kept. */
+void       ctrans_suspend_transaction (Transaction* pTrans) ;
+/** @brief Commits the transaction.
+ *
+ * Jumps back to NEWTRANSACTION (or RESUMETRANSACTION) where 
+ * transaction_stop runs. A long-lived transaction that is suspended is
+ * committed right away and this function returns.
+ */
 void       ctrans_finish_transaction(Transaction* pTrans) ;
+/** @brief Gives a finished transaction back to the per-thread pool.
+ *
+ * Called by NEWTRANSACTION once transaction_stop or exception_captured
+ * returns. pTrans must not be used afterwards. Recycled transactions keep
+ * their stack backup and sDebug buffers, so in steady state starting and
+ * ending a transaction does not call the allocator.
+ */
+void       ctrans_release_transaction(Transaction* pTrans) ;
 gpointer   ctrans_try_malloc (Transaction* trans, gsize n_bytes, gboolean bRaiseException) ;
+/** @brief Releases a block of pTrans before the transaction ends.
+ *
+ * mem must come from one of the ctrans allocators called on pTrans.
+ * Heap blocks are unlinked and freed in O(1), so a long transaction
+ * streaming data runs in bounded memory. In the arena only the most
+ * recent block is given back (LIFO use, as a temporary buffer), any
+ * other is kept until the end. A savepoint rollback does not bring
+ * back blocks freed after it was pushed.
+ */
+void       ctrans_free (Transaction* pTrans, gpointer mem) ;
+/** @brief Zeroed array of n_blocks blocks of n_block_bytes, owned by pTrans. */
+gpointer   ctrans_try_calloc (Transaction* pTrans, gsize n_blocks, gsize n_block_bytes, 
+               gboolean bRaiseException) ;
+/** @brief Resizes a block returned by the ctrans allocators of pTrans.
+ *
+ * Heap blocks are resized in place (g_try_realloc or mremap). In the
+ * arena the block grows in place when it's the most recent block of the
+ * transaction and no savepoint was pushed after it was allocated, so
+ * a buffer appended to in a loop is rarely copied. Otherwise a new
+ * block is returned and the old one is released as with ctrans_free.
+ * mem NULL behaves as ctrans_try_malloc. The budget is charged with the
+ * growth and given back what a shrink releases. On failure mem is left
+ * untouched.
+ */
+gpointer   ctrans_try_realloc (Transaction* pTrans, gpointer mem, gsize n_bytes, 
+               gboolean bRaiseException) ;
+/*
+ * String copies owned by pTrans. As g_strdup and friends, but they
+ * raise NO_RESOURCE_AVAILABLE (or CTRANS_BUDGET_EXCEEDED) on failure.
+ * ctrans_strndup copies at most n bytes and does not pad.
+ */
+gchar*     ctrans_strdup (Transaction* pTrans, const gchar* str) ;
+gchar*     ctrans_strndup (Transaction* pTrans, const gchar* str, gsize n) ;
+gchar*     ctrans_strdup_printf (Transaction* pTrans, const gchar* format, ...) G_GNUC_PRINTF(2, 3) ;
+gchar*     ctrans_strdup_vprintf (Transaction* pTrans, const gchar* format, va_list args) ;
 // TODO(1) ctrans_free_resources is probably private to transactions.c
 void       ctrans_free_resources (Transaction* trans) ;
+/** @brief Frees the chunks the calling thread keeps for CTRANS_WARM_ARENA
+ * transactions whose name was not started for idle_us microseconds.
+ *
+ * 0 frees them all. Meant for idle callbacks of threads that stop
+ * starting transactions for a while.
+ */
+void       ctrans_warm_arena_trim (gint64 idle_us) ;
+
+/*
+ * Memory budgets. ctrans_try_malloc counts the bytes requested by each
+ * transaction (and released by savepoint rollbacks) and refuses any
+ * request going over the budget, raising CTRANS_BUDGET_EXCEEDED if
+ * bRaiseException is TRUE or returning NULL otherwise. Contrary to a
+ * NULL from the system allocator (that never happens with overcommit)
+ * this fires before the process grows out of control.
+ */
+#define CTRANS_BUDGET_EXCEEDED (NO_RESOURCE_AVAILABLE | 1000001) // codes below 2000000 are reserved to the library
+
+/** @brief Sets the budget of pTrans in bytes. 0 removes the limit. */
+void       ctrans_set_budget (Transaction* pTrans, gsize max_bytes) ;
+/** @brief Default budget of the transactions named sDebug started from now on. 
+ *
+ * 0 removes it. It applies to transactions created afterwards, in any thread.
+ */
+void       ctrans_set_name_budget (const gchar* sDebug, gsize max_bytes) ;
+/** @brief Budget shared by all transactions started from now on. 0 removes it.
+ *
+ * Costs an atomic operation per ctrans_try_malloc while it's set.
+ */
+void       ctrans_set_global_budget (gsize max_bytes) ;
+
+/** @brief Registers a cleanup to run when the transaction ends.
+ *
+ * fn(arg) is called both on commit and on rollback, in reverse order
+ * of registration, before the transaction memory is freed. Rolling back
+ * to a savepoint runs only the cleanups registered after it.
+ * The first CTRANS_DEFER_INLINE registrations do not allocate.
+ * fn must not raise exceptions.
+ */
+void       ctrans_defer (Transaction* pTrans, CtransCleanupFunc fn, gpointer arg) ;
+
+/** @brief Registers fn(pTrans, arg) to run when pTrans commits.
+ *
+ * Prepare hooks run in registration order at the start of the commit,
+ * while everything the transaction acquired is still there. They can
+ * refuse the commit by raising an exception (the transaction is rolled
+ * back) or by calling ctrans_restart_transaction. They are dropped,
+ * without running, when the transaction is rolled back. A hook
+ * registered by a running hook runs after all of them, so a hook
+ * registering itself again becomes the last step of the commit.
+ * Registering more than CTRANS_PREPARE_HOOKS raises an IMPLEMENTATION
+ * exception on pTrans: it can't commit without its hooks.
+ */
+void       ctrans_on_prepare (Transaction* pTrans, CtransPrepareFunc fn, gpointer arg) ;
+
+/** @brief Rolls pTrans back and runs it again from NEWTRANSACTION.
+ *
+ * Everything acquired is released as for an exception, then the jump
+ * returns TRANS_RESTART: FUN_START and the code after NEWTRANSACTION
+ * run again. Used by the optimistic concurrency control of
+ * libctrans_stm.h. A long-lived transaction has no frame to restart
+ * from: it raises an IMPLEMENTATION exception instead, so it's rolled
+ * back (a prepare hook calling it still refuses the commit).
+ */
+void       ctrans_restart_transaction (Transaction* pTrans) ;
+
+/*
+ * Undo log. Memory living outside of the transaction (a structure that
+ * existed before it) is modified through these calls, which first save
+ * the old bytes in a log of the transaction. A rollback, of the
+ * transaction or of a savepoint, writes them back newest first, before
+ * cleanups run and memory is freed. Commit just forgets the log, except
+ * for a child transaction: its log is appended to the parent's, which
+ * can still roll back. Writing the same location twice in a row at the
+ * same savepoint level is only logged once.
+ */
+/** @brief Saves the n_bytes at dest before the caller modifies them. */
+void       ctrans_undo_save (Transaction* pTrans, gconstpointer dest, gsize n_bytes) ;
+/** @brief memcpy undone on rollback. */
+void       ctrans_memcpy (Transaction* pTrans, gpointer dest, gconstpointer src, gsize n_bytes) ;
+/* Assignment undone on rollback. LVALUE is evaluated twice. */
+#define CTRANS_WRITE(POINTERTRANS, LVALUE, VALUE) \
+    do { \
+        ctrans_undo_save(POINTERTRANS, &(LVALUE), sizeof(LVALUE)); \
+        (LVALUE) = (VALUE); \
+    } while (0)
+
+/** @brief Pushes a savepoint on the transaction. 
+ *
+ * While it's active an exception raised on pTrans only rolls back the
+ * resources acquired since the savepoint and jumps to its jmpTarget
+ * (see NEWSAVEPOINT) instead of aborting the whole transaction.
+ */
+void       ctrans_savepoint_push (Transaction* pTrans, CtransSavepoint* pSavepoint) ;
+/** @brief Pops the savepoint keeping everything acquired since it was pushed. */
+void       ctrans_savepoint_release (Transaction* pTrans, CtransSavepoint* pSavepoint) ;
+/** @brief Releases everything acquired since the savepoint was pushed.
+ *
+ * No jump is done and the savepoint stays active so the step can be
+ * retried right away. Savepoints pushed after pSavepoint are discarded.
+ */
+void       ctrans_rollback_to_savepoint (Transaction* pTrans, CtransSavepoint* pSavepoint) ;
+
+/*
+ * Bulk processing. fn is called for each record inside pTrans, each call
+ * under its own savepoint: when it raises only the resources acquired
+ * for that record are released and the exception is copied to its
+ * result, texts included (formatted if raised with ctrans_raise_message),
+ * before they go. The other records keep everything they acquired.
+ */
+typedef void     (*CtransRecordFunc) (Transaction* pTrans, gpointer record, gpointer user_data);
+/* Returns the next record or NULL at the end. */
+typedef gpointer (*CtransRecordIter) (gpointer iter_data);
+
+typedef struct {
+    gboolean            failed;
+    recipient_exception exception; // valid if failed. The strings live until pTrans ends
+} CtransRecordResult;
+
+/** @brief Calls fn for each of the n_records records of size record_size 
+ *   starting at records.
+ *
+ * Returns a vector with one result per record, allocated in pTrans
+ * (freed when pTrans ends). If it can't be allocated the exception is
+ * raised, and NULL is returned when a handler resumes it.
+ * \param n_failed if not NULL receives the number of records that raised.
+ */
+CtransRecordResult* ctrans_process_records (Transaction* pTrans, gpointer records, 
+               gsize record_size, guint n_records, CtransRecordFunc fn, gpointer user_data,
+               guint* n_failed) ;
+/** @brief Same as ctrans_process_records for the records returned by next.
+ *
+ * Returns the number of records processed. *results receives the result
+ * vector, allocated in pTrans. If it can't be allocated or grown the
+ * exception is raised; when a handler resumes it the records processed
+ * so far are returned and the rest are left in the iterator.
+ */
+guint      ctrans_process_iter (Transaction* pTrans, CtransRecordIter next, gpointer iter_data,
+               CtransRecordFunc fn, gpointer user_data, CtransRecordResult** results,
+               guint* n_failed) ;
+
+/** @brief Fills stats with the counters of all transactions, every thread merged. */
+void       ctrans_stats_get (CtransStats* stats) ;
+/** @brief Same as ctrans_stats_get for the transactions named sDebug.
+ *
+ * Returns FALSE if no transaction with that name was ever started.
+ */
+gboolean   ctrans_stats_get_by_name (const gchar* sDebug, CtransStats* stats) ;
+/** @brief Calls fn once per transaction name with its merged counters.
+ *
+ * Rates follow from two calls separated by a known interval.
+ */
+void       ctrans_stats_foreach (CtransStatsFunc fn, gpointer user_data) ;
 
 /** @brief Raises/throws a new sender exception.
  *
  * Sender exceptions will be used in libraries. Libraries
  * are not context-aware so they will limit to raise a new exception
  * with as many info as possible.
+ * The exception object is stored inside the transaction
+ * (pTrans->raisedException), no memory is allocated. It's valid until
+ * exception_captured returns or a new exception is raised on pTrans.
+ * The strings are not copied.
+ * This function only returns when a handler of the transaction
+ * handler table resumes the exception, or when pTrans is a suspended
+ * long-lived transaction (exception_captured has already run then).
  * At the time of writing (2010-03) its utility is limited.
  * It's implemented just for simetry with the recipient_exceptions.
  * GError (http://library.gnome.org/devel/glib/2.23/glib-Error-Reporting.html)
@@ -313,6 +815,53 @@ void ctrans_raise_sender_exception(Transaction* pTrans,
     guint32 type, char* description_i18n, char* detail_i18n) ;
 
 typedef enum { USER=1100000, ADMIN=1200000, IMPLEMENTATION=1300000 } recipEx_type;
+
+/*
+ * Standard sender exception classes. They live in the high bits of the
+ * exception type, so they can be or'ed together and with a custom
+ * integer (2000000-3000000), for example TIMEOUT|2000042.
+ */
+typedef enum { 
+    IOEXCEPTION           = 1<<24,
+    TIMEOUT               = 1<<25,
+    NO_RESOURCE_AVAILABLE = 1<<26,
+    INVALID_ARGUMENT      = 1<<27,
+    BACKPRESSURE          = 1<<28 
+} senderEx_type;
+
+#define CTRANS_EXCEPTION_CLASS_SHIFT 24
+#define CTRANS_EXCEPTION_CLASS_BITS  7
+#define CTRANS_EXCEPTION_CLASSES(type) (((guint32)(type) >> CTRANS_EXCEPTION_CLASS_SHIFT) & \
+                                        ((1 << CTRANS_EXCEPTION_CLASS_BITS) - 1))
+
+typedef enum { CTRANS_HANDLER_ABORT=0, CTRANS_HANDLER_RESUME=1 } CtransHandlerResult;
+
+/*
+ * Exception handler. Called from the raise function, before anything is
+ * rolled back. Returning CTRANS_HANDLER_RESUME makes the raise function
+ * return to its caller as if nothing happened. CTRANS_HANDLER_ABORT
+ * continues as usual (savepoint or exception_captured).
+ */
+typedef CtransHandlerResult (*CtransExceptionHandler) (Transaction* pTrans, 
+    exception_base* exception, gpointer user_data);
+
+/** @brief Creates an empty handler table. 
+ *
+ * A table is filled once (ctrans_handler_table_set) and then shared,
+ * read-only, by any number of transactions and threads.
+ */
+CtransHandlerTable* ctrans_handler_table_new (void) ;
+void       ctrans_handler_table_free (CtransHandlerTable* table) ;
+/** @brief Registers handler for every class in class_mask.
+ *
+ * A raised exception is dispatched to the handler of its lowest class
+ * bit in O(1). class_mask 0 sets the handler for exceptions without
+ * any standard class (recipient exceptions, plain custom integers).
+ */
+void       ctrans_handler_table_set (CtransHandlerTable* table, guint32 class_mask, 
+               CtransExceptionHandler handler, gpointer user_data) ;
+/** @brief Attaches table to pTrans. Children created later inherit it. */
+void       ctrans_set_handler_table (Transaction* pTrans, CtransHandlerTable* table) ;
 /**
  * @brief Raises/throws a new recipient exception.
  *
@@ -325,6 +874,9 @@ typedef enum { USER=1100000, ADMIN=1200000, IMPLEMENTATION=1300000 } recipEx_typ
  * sensible (sending a polity warning to the user or an SMS to the 
  * server administrator).
  *
+ * As for sender exceptions the object is embedded in the transaction
+ * and lives until exception_captured returns.
+ *
  * \param pTrans is the pointer to the active transaction.
  * \param type   provides simple and limited support to type the exception.
  * \param description_i18n human readable text 
@@ -338,40 +890,196 @@ typedef enum { USER=1100000, ADMIN=1200000, IMPLEMENTATION=1300000 } recipEx_typ
 void ctrans_raise_recipient_exception(Transaction* pTrans,
     recipEx_type type, char* description_i18n, char* detail_i18n, char* solution_i18n) ;
 
+/** @brief Raises on pTrans the exception raised on another transaction.
+ *
+ * exception must be the raisedException of a transaction (or a copy of
+ * it). Its texts are copied to a buffer of pTrans, kept when pTrans is
+ * recycled, so exception can be freed right after. A message not
+ * formatted yet is copied with its arguments and stays unformatted. Used to carry the
+ * exception of a task to the transaction joining it (see
+ * libctrans_threadpool.h).
+ */
+void ctrans_raise_copy(Transaction* pTrans, const exception_base* exception) ;
+
+/** @brief Adds a message to the catalog, or returns the id name already has.
+ *
+ * \param name   unique key of the message, for example "invoice.bad_amount".
+ * \param type   type of the exceptions raised with it, as for
+ *     ctrans_raise_sender_exception or ctrans_raise_recipient_exception.
+ * \param description_fmt printf format of description_i18n.
+ * \param detail_fmt    printf format of detail_i18n, can be NULL.
+ * \param solution_fmt  printf format of solution_i18n, can be NULL.
+ *
+ * The three formats take their arguments from the same list: each one
+ * starts at the first argument, and %N$ picks the Nth. The conversions
+ * supported are d i u o x X c (with hh h l ll z), e f g a, s and p,
+ * without '*'. The strings are interned. Returns 0 if a format is not
+ * supported or the catalog is full. Usually called at startup, but
+ * it's thread safe.
+ */
+CtransMessageId ctrans_message_register (const gchar* name, guint32 type, 
+               const gchar* description_fmt, const gchar* detail_fmt, const gchar* solution_fmt) ;
+/** @brief Id of the message registered as name, 0 if there is none. */
+CtransMessageId ctrans_message_lookup (const gchar* name) ;
+
+/** @brief Raises the exception of a message of the catalog.
+ *
+ * The arguments follow message, as for its formats. Nothing is
+ * formatted: they are stored in the exception (args) and its texts
+ * stay NULL until a handler or a logger calls ctrans_format_exception.
+ * Expected exceptions that are resumed or just counted never pay for
+ * building strings. String arguments are not copied: they must live
+ * until the exception is handled (literals, memory of a parent).
+ * An unknown message (0 from a failed registration) raises an
+ * IMPLEMENTATION exception naming it instead.
+ */
+void ctrans_raise_message(Transaction* pTrans, CtransMessageId message, ...) ;
+
+/** @brief Formats the texts of exception, raised on pTrans.
+ *
+ * Does nothing if the texts are already there (raised with them or
+ * formatted before). The texts live in a buffer of pTrans until
+ * ctrans_raise_copy or the next format on pTrans.
+ */
+void ctrans_format_exception(Transaction* pTrans, exception_base* exception) ;
+
+/**
+ * @brief Returns the innermost active transaction of the calling thread.
+ *
+ * Each thread keeps its own stack of active transactions: NEWTRANSACTION
+ * pushes and the end of the transaction pops. No lock is involved, so
+ * different threads run independent transactions concurrently.
+ * Returns NULL outside of any transaction.
+ */
+Transaction* ctrans_current (void) ;
+
+/*
+ * Same as ctrans_try_malloc/ctrans_raise_*_exception/ctrans_raise_message acting on
+ * ctrans_current(), so the Transaction* does not need to be passed down
+ * to every function. Calling them outside of a transaction aborts.
+ */
+gpointer   ctrans_current_try_malloc (gsize n_bytes, gboolean bRaiseException) ;
+void       ctrans_current_raise_sender_exception(guint32 type, 
+               char* description_i18n, char* detail_i18n) ;
+void       ctrans_current_raise_recipient_exception(recipEx_type type, 
+               char* description_i18n, char* detail_i18n, char* solution_i18n) ;
+void       ctrans_current_raise_message(CtransMessageId message, ...) ;
+
 /*
  * TODO(0): Add a function FUN_END_COMMON (common to fun_stop and fun_exc)
  */
 
+/*
+ * POINTERTRANS must be a plain variable name: it's used to name the
+ * hidden label and locals, so several transactions (for example a
+ * parent and its children) can live in the same function.
+ */
 #define NEWTRANSACTION(POINTERTRANS, FUN_START, FUN_STOP, FUN_EXC, SDEBUG) \
-    void (*exceptionHandle)  (Transaction*); \
-    void (*transStartHandle) (Transaction*); \
-    void (*transStopHandle)  (Transaction*); \
-    guint32 stackTop; \
-    exceptionHandle  = FUN_EXC; \
-    transStartHandle = FUN_START; \
-    transStopHandle  = FUN_STOP; \
-    int tranState = ctrans_new_transaction(&stackTop, &POINTERTRANS, 0, SDEBUG); \
-    if (tranState == EXCEPTION_CAPTURED ){ \
+    NEWTRANSACTION_FULL(POINTERTRANS, FUN_START, FUN_STOP, FUN_EXC, SDEBUG, CTRANS_DEFAULT)
+
+#define NEWTRANSACTION_FULL(POINTERTRANS, FUN_START, FUN_STOP, FUN_EXC, SDEBUG, FLAGS) \
+    NEWCHILDTRANSACTION_FULL(POINTERTRANS, 0, FUN_START, FUN_STOP, FUN_EXC, SDEBUG, FLAGS)
+
+/*
+ * Starts a transaction nested in PARENTTRANS. It ends (and its resources
+ * are freed) no later than its parent.
+ */
+#define NEWCHILDTRANSACTION(POINTERTRANS, PARENTTRANS, FUN_START, FUN_STOP, FUN_EXC, SDEBUG) \
+    NEWCHILDTRANSACTION_FULL(POINTERTRANS, PARENTTRANS, FUN_START, FUN_STOP, FUN_EXC, SDEBUG, CTRANS_DEFAULT)
+
+#define NEWCHILDTRANSACTION_FULL(POINTERTRANS, PARENTTRANS, FUN_START, FUN_STOP, FUN_EXC, SDEBUG, FLAGS) \
+    guint32 stackTop_##POINTERTRANS; \
+    ctrans_new_transaction_full(&stackTop_##POINTERTRANS, &POINTERTRANS, PARENTTRANS, SDEBUG, FLAGS); \
+    switch (setjmp(POINTERTRANS->transStart)) { \
+    case EXCEPTION_CAPTURED: \
         FUN_EXC(POINTERTRANS); \
-        g_free(POINTERTRANS->stack_backup); \
-        g_free(POINTERTRANS->sDebug); \
-        g_free(POINTERTRANS); \
-        goto ENDTRANS; \
-    } else if ( tranState == TRANS_STOP) { \
+        ctrans_release_transaction(POINTERTRANS); \
+        goto ENDTRANS_##POINTERTRANS; \
+    case TRANS_STOP: \
         FUN_STOP(POINTERTRANS); \
-        g_free(POINTERTRANS->stack_backup); \
-        g_free(POINTERTRANS->sDebug); \
-        g_free(POINTERTRANS); \
-        goto ENDTRANS; \
-    } else { \
+        ctrans_release_transaction(POINTERTRANS); \
+        goto ENDTRANS_##POINTERTRANS; \
+    default: \
         FUN_START(POINTERTRANS); \
     } 
 
 
 #define ENDTRANSACTION(POINTERTRANS) \
     ctrans_finish_transaction(POINTERTRANS); \
-ENDTRANS: \
+ENDTRANS_##POINTERTRANS: \
     if(TRUE) TRUE; // avoid compiler warnings with empty stuff
+
+/*
+ * Long-lived transactions span several callbacks of a main loop (a
+ * dialog, a network session). POINTERTRANS must outlive the callback
+ * (static or heap storage). Every callback touching the transaction
+ * opens a block that is closed with SUSPENDTRANSACTION in the same
+ * function:
+ * <pre>
+ *   on_open:   NEWLONGTRANSACTION(pTrans, start, stop, exc, "dialog", CTRANS_DEFAULT);
+ *              ...
+ *              SUSPENDTRANSACTION(pTrans);
+ *
+ *   on_button: RESUMETRANSACTION(pTrans);
+ *              ...                           // may raise
+ *              ctrans_finish_transaction(pTrans); // commit
+ *              SUSPENDTRANSACTION(pTrans);
+ * </pre>
+ * Inside the block it behaves as a plain transaction. Once it commits
+ * or aborts FUN_STOP/FUN_EXC run, POINTERTRANS is set to NULL and the
+ * execution continues after SUSPENDTRANSACTION. Start and end cost the
+ * same whatever the stack depth: no stack is ever copied.
+ */
+#define NEWLONGTRANSACTION(POINTERTRANS, FUN_START, FUN_STOP, FUN_EXC, SDEBUG, FLAGS) \
+    ctrans_new_long_transaction(&POINTERTRANS, SDEBUG, FLAGS, FUN_STOP, FUN_EXC); \
+    CTRANS_RESUME_BLOCK(POINTERTRANS, FUN_START(POINTERTRANS))
+
+#define RESUMETRANSACTION(POINTERTRANS) \
+    CTRANS_RESUME_BLOCK(POINTERTRANS, ;)
+
+#define SUSPENDTRANSACTION(POINTERTRANS) \
+    ctrans_suspend_transaction(POINTERTRANS); \
+SUSPENDTRANS_##POINTERTRANS: \
+    if(TRUE) TRUE;
+
+#define CTRANS_RESUME_BLOCK(POINTERTRANS, ON_START) \
+    ctrans_resume_transaction(POINTERTRANS); \
+    switch (setjmp(POINTERTRANS->transStart)) { \
+    case EXCEPTION_CAPTURED: \
+        POINTERTRANS->fun_exc(POINTERTRANS); \
+        ctrans_release_transaction(POINTERTRANS); \
+        POINTERTRANS = NULL; \
+        goto SUSPENDTRANS_##POINTERTRANS; \
+    case TRANS_STOP: \
+        POINTERTRANS->fun_stop(POINTERTRANS); \
+        ctrans_release_transaction(POINTERTRANS); \
+        POINTERTRANS = NULL; \
+        goto SUSPENDTRANS_##POINTERTRANS; \
+    default: \
+        ON_START; \
+    }
+
+/*
+ * Pushes SAVEPOINT (a CtransSavepoint variable) and opens an if/else:
+ * <pre>
+ *   CtransSavepoint sp;
+ *   NEWSAVEPOINT(pTrans, sp) {
+ *       risky_step(pTrans);
+ *       RELEASESAVEPOINT(pTrans, sp);
+ *   } else {
+ *       // Only the resources of risky_step were released.
+ *       // pTrans->raisedException holds the exception.
+ *   }
+ * </pre>
+ * Locals modified inside the first block and read in the else branch 
+ * (a retry counter, for example) must be volatile.
+ */
+#define NEWSAVEPOINT(POINTERTRANS, SAVEPOINT) \
+    ctrans_savepoint_push(POINTERTRANS, &(SAVEPOINT)); \
+    if (setjmp((SAVEPOINT).jmpTarget) == 0)
+
+#define RELEASESAVEPOINT(POINTERTRANS, SAVEPOINT) \
+    ctrans_savepoint_release(POINTERTRANS, &(SAVEPOINT))
     
 
 
@@ -0,0 +1,84 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** @file libctrans_mainloop.h
+ *
+ * @brief GMainLoop integration: events dispatched inside transactions.
+ *
+ * A CtransEventSource is a GSource holding a queue of events. Any
+ * thread can push events; the thread running the GMainContext the
+ * source is attached to dispatches them to a handler.
+ *
+ * Events are dispatched in batches of up to max_batch events sharing a
+ * single transaction. Each event runs under its own savepoint, so when
+ * the handler raises only the resources of that event are released
+ * and the error function is called for it. The other events of the
+ * batch go on and everything they acquired is kept until the batch
+ * commits (transaction_stop of the batch). This saves the start and
+ * end of a transaction per event under load. With max_batch 1 it's
+ * the same as the NEWTRANSACTION per event of test2.c.
+ */
+
+#include "libctrans.h"
+
+#ifndef __CTRANSACTIONS_MAINLOOP__
+#define __CTRANSACTIONS_MAINLOOP__
+
+/*
+ * Maximum number of events dispatched in one transaction when
+ * ctrans_event_source_new is given max_batch 0.
+ */
+#define CTRANS_EVENT_BATCH_SIZE 64
+
+/*
+ * Processes one event. Resources must be acquired on pTrans, they are
+ * kept until the whole batch ends. It can raise exceptions but must
+ * not end pTrans.
+ */
+typedef void (*CtransEventHandler) (Transaction* pTrans, gpointer event,
+    gpointer user_data);
+
+/*
+ * Called for an event whose handler raised, once the resources of the
+ * event have been released. pTrans->raisedException holds the exception.
+ * It runs under a savepoint too: if it raises, what it acquired is
+ * released, a warning is logged and the batch goes on.
+ */
+typedef void (*CtransEventErrorFunc) (Transaction* pTrans, gpointer event,
+    gpointer user_data);
+
+/** @brief Creates a source dispatching events to handler.
+ *
+ * \param sDebug     name of the batch transactions.
+ * \param flags      CTRANS_* flags of the batch transactions.
+ * \param max_batch  events per transaction, 0 for CTRANS_EVENT_BATCH_SIZE.
+ * \param handler    called for each event.
+ * \param on_error   called for each failed event. If NULL a warning is logged.
+ * \param event_free called for each event once its batch ends (may be NULL).
+ *
+ * Attach it with g_source_attach and drop it with g_source_destroy /
+ * g_source_unref as any other GSource.
+ */
+GSource*   ctrans_event_source_new (const gchar* sDebug, guint flags, guint max_batch,
+               CtransEventHandler handler, CtransEventErrorFunc on_error,
+               GDestroyNotify event_free, gpointer user_data) ;
+
+/** @brief Queues an event (not NULL). Can be called from any thread. */
+void       ctrans_event_source_push (GSource* source, gpointer event) ;
+
+#endif
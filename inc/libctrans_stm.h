@@ -0,0 +1,68 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** @file libctrans_stm.h
+ *
+ * @brief Software transactional memory: shared cells read and written
+ * by transactions of several threads without a global lock.
+ *
+ * A cell is any gsize (or gpointer) shared between threads. Inside a
+ * transaction it's only accessed with ctrans_stm_read/ctrans_stm_write
+ * (outside of any transaction it must not be written at all).
+ *
+ * Cells are mapped to a table of CTRANS_STM_LOCKS versioned locks and
+ * a global clock orders the commits (TL2 style). Reads are invisible:
+ * they check that the lock of the cell is free and not newer than the
+ * snapshot of the transaction. Writes take the lock of the cell, save
+ * the old value in the undo log (see ctrans_undo_save) and write in
+ * place. At commit (ENDTRANSACTION) the cells read are validated and
+ * the locks released with a new version. A transaction that only read
+ * commits without touching any shared state.
+ *
+ * On a conflict the outermost transaction is rolled back, the undo log
+ * puts the old values back, and it's run again from NEWTRANSACTION
+ * (ctrans_restart_transaction): FUN_START and the body are executed
+ * once more, so they must not have effects other than through the
+ * transaction. Consecutive conflicts of a thread back off. Child
+ * transactions share the locks and snapshot of their outermost parent.
+ * Long-lived transactions can't restart: their conflicts raise
+ * CTRANS_STM_CONFLICT.
+ */
+
+#include "libctrans.h"
+
+#ifndef __CTRANSACTIONS_STM__
+#define __CTRANSACTIONS_STM__
+
+/*
+ * Number of versioned locks (a power of 2). Different cells may share
+ * a lock, which only causes false conflicts.
+ */
+#define CTRANS_STM_LOCKS    (1<<16)
+
+#define CTRANS_STM_CONFLICT (BACKPRESSURE | 1000002) // codes below 2000000 are reserved to the library
+
+/** @brief Value of cell as seen by pTrans. */
+gsize      ctrans_stm_read (Transaction* pTrans, const gsize* cell) ;
+/** @brief Sets cell to value, published when the outermost transaction commits. */
+void       ctrans_stm_write (Transaction* pTrans, gsize* cell, gsize value) ;
+/* Same as above for cells holding pointers */
+gpointer   ctrans_stm_read_pointer (Transaction* pTrans, gpointer const* cell) ;
+void       ctrans_stm_write_pointer (Transaction* pTrans, gpointer* cell, gpointer value) ;
+
+#endif
@@ -0,0 +1,90 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** @file libctrans_threadpool.h
+ *
+ * @brief Fork-join of tasks running in parallel, each in its own transaction.
+ *
+ * A transaction is bound to the thread that started it, so work can't
+ * be spread by sharing one. Instead a parent transaction creates a
+ * task group and forks tasks into it. Each task runs on a worker of
+ * a CtransPool inside a transaction of its own (named after the group),
+ * and everything it acquires is released when the task ends.
+ *
+ * ctrans_join waits for all the tasks of the group. If any of them
+ * raised, the tasks not started yet are skipped and the first exception
+ * is raised again on the parent at the join, as if it had been raised
+ * there. Its texts are formatted and copied before the memory of the
+ * task is released, so they can be built in it (ctrans_strdup_printf,
+ * string arguments of ctrans_raise_message). If the
+ * parent is rolled back before joining, the group waits
+ * for its running tasks (and cancels the others) while the parent
+ * releases its resources.
+ *
+ * Each worker owns a deque of tasks. A worker forking (nested groups)
+ * pushes to its own deque and pops from the same end, so the most
+ * recent (cache hot) task runs first. Idle workers steal from the
+ * other end of the other deques. Threads waiting in ctrans_join run
+ * queued tasks meanwhile, so nested fork-join never runs out of
+ * workers.
+ *
+ * Tasks must not use the parent transaction: put the inputs and the
+ * room for the results in memory allocated before forking and let
+ * each task write only its own part.
+ */
+
+#include "libctrans.h"
+
+#ifndef __CTRANSACTIONS_THREADPOOL__
+#define __CTRANSACTIONS_THREADPOOL__
+
+typedef struct _CtransPool CtransPool;
+typedef struct _CtransTaskGroup CtransTaskGroup;
+
+/*
+ * Body of a task. pTrans is the transaction of the task, in the worker
+ * thread. It can raise exceptions or commit with ctrans_finish_transaction.
+ */
+typedef void (*CtransTaskFunc) (Transaction* pTrans, gpointer data);
+
+/** @brief Starts n_workers threads, 0 for one per processor. */
+CtransPool*      ctrans_pool_new (guint n_workers) ;
+/** @brief Runs the tasks still queued and stops the workers. */
+void             ctrans_pool_free (CtransPool* pool) ;
+
+/** @brief Creates a group of tasks owned by pParent.
+ *
+ * \param sDebug name of the task transactions.
+ * \param flags  CTRANS_* flags of the task transactions.
+ *
+ * The group is freed when pParent ends, or when the savepoint of
+ * pParent active at creation is rolled back. The tasks inherit the
+ * handler table of pParent.
+ */
+CtransTaskGroup* ctrans_task_group_new (Transaction* pParent, CtransPool* pool,
+                     const gchar* sDebug, guint flags) ;
+/** @brief Queues fn(task transaction, data). Can be called from the parent or from a task. */
+void             ctrans_fork (CtransTaskGroup* group, CtransTaskFunc fn, gpointer data) ;
+/** @brief Waits for every task forked into group. Called from the parent thread.
+ *
+ * Raises on the parent a copy of the exception of the first task that
+ * failed. The group can be used again afterwards.
+ */
+void             ctrans_join (CtransTaskGroup* group) ;
+
+#endif
@@ -0,0 +1,78 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** @file libctrans_wal.h
+ *
+ * @brief Durable transactions: redo records written to an append-only
+ * log file when the transaction commits.
+ *
+ * A transaction appends records with ctrans_log_append. They are kept
+ * in memory until the outermost transaction commits: ENDTRANSACTION
+ * then writes them as one frame and returns once the frame is on disk.
+ * A rollback (an exception, a savepoint, a child transaction that
+ * fails) drops the records appended since, without any I/O.
+ *
+ * Commits of several threads on the same log share the fsync (group
+ * commit): the first committer writes and syncs every frame queued so
+ * far while the others wait, and the frames queued meanwhile go in
+ * the next sync. The cost of a sync is paid per batch, not per
+ * transaction.
+ *
+ * Each frame carries its length and a CRC32. ctrans_log_open replays
+ * the frames of the file and cuts a torn or corrupt tail (a crash
+ * in the middle of a write), so only whole transactions are seen.
+ *
+ * The log is written at the end of the commit, after the other prepare
+ * hooks (ctrans_on_prepare) accepted it. If the write or the sync fails
+ * the transaction raises CTRANS_LOG_FAILED and the log refuses any
+ * other commit: close it and open it again.
+ */
+
+#include "libctrans.h"
+
+#ifndef __CTRANSACTIONS_WAL__
+#define __CTRANSACTIONS_WAL__
+
+#define CTRANS_LOG_FAILED (IOEXCEPTION | 1000003) // codes below 2000000 are reserved to the library
+
+typedef struct _CtransLog CtransLog;
+
+/*
+ * Called by ctrans_log_open for every record of the log, in commit
+ * order. record is 8 bytes aligned and only valid during the call.
+ */
+typedef void (*CtransLogReplayFunc) (gconstpointer record, gsize n_bytes, gpointer data);
+
+/** @brief Opens (or creates) the log file at path and replays it.
+ *
+ * \param replay called for each record found, can be NULL.
+ *
+ * Returns NULL and sets error if the file can't be opened or read.
+ */
+CtransLog* ctrans_log_open (const gchar* path, CtransLogReplayFunc replay, gpointer data,
+                   GError** error) ;
+/** @brief Closes the log. No transaction may be committing on it. */
+void       ctrans_log_close (CtransLog* log) ;
+/** @brief Empties the log, once what it holds was saved some other way (a checkpoint). */
+gboolean   ctrans_log_truncate (CtransLog* log, GError** error) ;
+
+/** @brief Adds a copy of record to the frame pTrans writes to log when it commits. */
+void       ctrans_log_append (Transaction* pTrans, CtransLog* log, gconstpointer record,
+                   gsize n_bytes) ;
+
+#endif
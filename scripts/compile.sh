@@ -6,16 +6,30 @@ TST="../tests"
 TARGET="../target"
 
 DEBUGOPTS="-ggdb"
+CTRANSOPTS="" # -DCTRANS_NO_STATS compiles the statistics out, -DCTRANS_NO_PROBES the tracepoints
 
 PKGCONFIG0=" $(pkg-config --cflags glib-2.0)  $(pkg-config --libs glib-2.0) -I ${INC}"
 PKGCONFIG1=" ${PKGCONFIG0} $(pkg-config --cflags gtk+-2.0)  $(pkg-config --libs gtk+-2.0)"
 
 
-gcc ${DEBUGOPTS}  ${PKGCONFIG0} -c -fPIC ${SRC}/libctrans.c -o ${TARGET}/libctrans.o 
-gcc -shared -Wl,-soname,libctrans.so.1 -o ${TARGET}/libctrans.so.1   ${TARGET}/libctrans.o
+gcc ${DEBUGOPTS} ${CTRANSOPTS} ${PKGCONFIG0} -c -fPIC ${SRC}/libctrans.c -o ${TARGET}/libctrans.o 
+gcc ${DEBUGOPTS} ${CTRANSOPTS} ${PKGCONFIG0} -c -fPIC ${SRC}/libctrans_mainloop.c -o ${TARGET}/libctrans_mainloop.o 
+gcc ${DEBUGOPTS} ${CTRANSOPTS} ${PKGCONFIG0} -c -fPIC ${SRC}/libctrans_threadpool.c -o ${TARGET}/libctrans_threadpool.o 
+gcc ${DEBUGOPTS} ${CTRANSOPTS} ${PKGCONFIG0} -c -fPIC ${SRC}/libctrans_stm.c -o ${TARGET}/libctrans_stm.o 
+gcc ${DEBUGOPTS} ${CTRANSOPTS} ${PKGCONFIG0} -c -fPIC ${SRC}/libctrans_wal.c -o ${TARGET}/libctrans_wal.o 
+gcc -shared -Wl,-soname,libctrans.so.1 -o ${TARGET}/libctrans.so.1   ${TARGET}/libctrans.o ${TARGET}/libctrans_mainloop.o ${TARGET}/libctrans_threadpool.o ${TARGET}/libctrans_stm.o ${TARGET}/libctrans_wal.o
 
 GCCOPTS="-o dynamically_linked"
 
 gcc ${DEBUGOPTS} ${GCCOPTS} ${PKGCONFIG0} ${TARGET}/libctrans.so.1 ${TST}/test1.c -o ${TARGET}/test1 2>&1 
 gcc ${DEBUGOPTS} ${GCCOPTS} ${PKGCONFIG0} ${TARGET}/libctrans.so.1 ${TST}/test2.c -o ${TARGET}/test2 2>&1 
 gcc ${DEBUGOPTS} ${GCCOPTS} ${PKGCONFIG1} ${TARGET}/libctrans.so.1 ${TST}/test3.c -o ${TARGET}/test3 2>&1 
+gcc ${DEBUGOPTS} ${GCCOPTS} ${PKGCONFIG0} ${TARGET}/libctrans.so.1 ${TST}/test4.c -o ${TARGET}/test4 2>&1 
+gcc ${DEBUGOPTS} ${GCCOPTS} ${PKGCONFIG0} ${TARGET}/libctrans.so.1 ${TST}/test5.c -o ${TARGET}/test5 2>&1
+gcc ${DEBUGOPTS} ${GCCOPTS} ${PKGCONFIG0} ${TARGET}/libctrans.so.1 ${TST}/test6.c -o ${TARGET}/test6 2>&1
+gcc ${DEBUGOPTS} ${GCCOPTS} ${PKGCONFIG0} ${TARGET}/libctrans.so.1 ${TST}/test7.c -o ${TARGET}/test7 2>&1
+gcc ${DEBUGOPTS} ${GCCOPTS} ${PKGCONFIG0} ${TARGET}/libctrans.so.1 ${TST}/test8.c -o ${TARGET}/test8 2>&1
+gcc ${DEBUGOPTS} ${GCCOPTS} ${PKGCONFIG0} ${TARGET}/libctrans.so.1 ${TST}/test9.c -o ${TARGET}/test9 2>&1
+gcc ${DEBUGOPTS} ${GCCOPTS} ${PKGCONFIG0} ${TARGET}/libctrans.so.1 ${TST}/test10.c -o ${TARGET}/test10 2>&1
+gcc ${DEBUGOPTS} ${GCCOPTS} ${PKGCONFIG0} ${TARGET}/libctrans.so.1 ${TST}/test11.c -o ${TARGET}/test11 2>&1
+gcc ${DEBUGOPTS} ${GCCOPTS} ${PKGCONFIG0} ${TARGET}/libctrans.so.1 ${TST}/bench1.c -o ${TARGET}/bench1 2>&1 
@@ -20,159 +20,1926 @@
  * Created by Enrique Ariz'on Benito, 2010.  
  */
 
+#define _GNU_SOURCE // mremap
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
 #include "libctrans.h"
 
+/*
+ * Static tracepoints (USDT) of provider "libctrans". A probe is a single
+ * nop in the code until perf or bpftrace attaches to it, for example:
+ *   bpftrace -e 'usdt:libctrans.so.1:libctrans:raise 
+ *       { printf("%d %s %x\n", arg0, str(arg1), arg2); }'
+ * Arguments (id and sDebug always first):
+ *   new            sDebug, flags (before the transaction exists)
+ *   start          id, sDebug, flags (right before the setjmp of NEWTRANSACTION)
+ *   malloc         id, sDebug, n_bytes, result
+ *   free_resources id, sDebug
+ *   finish         id, sDebug
+ *   raise          id, sDebug, type
+ *   savepoint_rollback id, sDebug, type
+ *   jump           id, sDebug, state (TRANS_STOP or EXCEPTION_CAPTURED)
+ *   release        id, sDebug (once transaction_stop/exception_captured returned)
+ * Ids are given per thread, the tracer provides the thread id.
+ * Without <sys/sdt.h> (systemtap-sdt-dev) or with -DCTRANS_NO_PROBES
+ * they are not compiled.
+ */
+#if !defined(CTRANS_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CTRANS_HAVE_PROBES
+#endif
+#endif
+
+#ifdef CTRANS_HAVE_PROBES
+#define CTRANS_PROBE2(name, a1, a2)         DTRACE_PROBE2(libctrans, name, a1, a2)
+#define CTRANS_PROBE3(name, a1, a2, a3)     DTRACE_PROBE3(libctrans, name, a1, a2, a3)
+#define CTRANS_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(libctrans, name, a1, a2, a3, a4)
+#else
+#define CTRANS_PROBE2(name, a1, a2)
+#define CTRANS_PROBE3(name, a1, a2, a3)
+#define CTRANS_PROBE4(name, a1, a2, a3, a4)
+#endif
+
+/*
+ * Chunk of a transaction arena. The usable region starts
+ * CTRANS_ARENA_HEADER bytes after the chunk address.
+ */
+struct _CtransArenaChunk {
+    CtransArenaChunk* prev; // previously filled chunk
+    gsize             size; // usable bytes
+    gsize             used;
+};
+
+/*
+ * Chunks kept by a thread for the next CTRANS_WARM_ARENA transaction of
+ * a name (linked by prev). Entries are emptied but never removed, so
+ * Transaction.warm does not dangle while its thread lives.
+ */
+struct _CtransWarmArena {
+    CtransArenaChunk* chunks;
+    gsize             bytes;     // usable bytes of chunks
+    gint64            last_used; // CtransThreadState.warm_clock of the last start
+};
+
+#define CTRANS_WARM_ARENA_CLOCK_EVERY 64 // warm starts between two clock reads
+
+#define CTRANS_ALIGN_UP(n)    (((n) + CTRANS_ARENA_ALIGN - 1) & ~((gsize)CTRANS_ARENA_ALIGN - 1))
+#define CTRANS_ARENA_HEADER   CTRANS_ALIGN_UP(sizeof(CtransArenaChunk))
+
+/*
+ * Header right before the data of every block. size is what was
+ * requested (ctrans_try_realloc needs it). seq orders heap blocks for
+ * savepoint rollbacks and is not used in the arena.
+ */
+struct _CtransBlock {
+    gsize        seq;
+    gsize        size;
+};
+
+/*
+ * Heap blocks are also doubly linked, newest first, so ctrans_free can
+ * unlink them without searching.
+ */
+struct _CtransHeapBlock {
+    CtransHeapBlock* prev;   // older
+    CtransHeapBlock* next;   // newer, NULL for the head of allocated_memory
+    CtransBlock      block;
+};
+
+#define CTRANS_BLOCK_HEADER      CTRANS_ALIGN_UP(sizeof(CtransBlock))
+
+/*
+ * Undo log entry: the old bytes, padded to a pointer size, followed by
+ * this trailer, so the log is replayed walking back from its end.
+ */
+typedef struct {
+    gpointer dest;
+    gsize    n_bytes;
+} CtransUndoEntry;
+
+#define CTRANS_UNDO_PAD(n) (((n) + sizeof(gpointer) - 1) & ~(sizeof(gpointer) - 1))
+#define CTRANS_HEAP_HEADER       (G_STRUCT_OFFSET(CtransHeapBlock, block) + CTRANS_BLOCK_HEADER)
+#define CTRANS_BLOCK_DATA(block) ((gpointer)((guint8*)(block) + CTRANS_BLOCK_HEADER))
+#define CTRANS_DATA_BLOCK(mem)   ((CtransBlock*)((guint8*)(mem) - CTRANS_BLOCK_HEADER))
+#define CTRANS_HEAP_BLOCK(block) ((CtransHeapBlock*)((guint8*)(block) - G_STRUCT_OFFSET(CtransHeapBlock, block)))
+
+/*
+ * Large blocks live in their own mapping, after this header. A heap
+ * block is mapped if and only if its size is CTRANS_MMAP_THRESHOLD or
+ * more (resizing never moves a block across the threshold in place).
+ */
+typedef struct {
+    gsize length; // of the whole mapping
+    gsize pad;
+} CtransMapping;
+
+#define CTRANS_MAP_HEADER         CTRANS_ALIGN_UP(sizeof(CtransMapping))
+#define CTRANS_HEAP_MAPPING(heap) ((CtransMapping*)((guint8*)(heap) - CTRANS_MAP_HEADER))
+#define CTRANS_MAPPING_HEAP(map)  ((CtransHeapBlock*)((guint8*)(map) + CTRANS_MAP_HEADER))
+#define CTRANS_BLOCK_MAPPED(block) ((block)->size >= CTRANS_MMAP_THRESHOLD)
+// Arena transactions keep their mapped blocks in allocated_memory too
+#define CTRANS_BLOCK_IN_HEAP(pTrans, block) \
+    (!((pTrans)->flags & CTRANS_ALLOC_ARENA) || CTRANS_BLOCK_MAPPED(block))
+// Bigger requests are refused before any size computation can overflow
+#define CTRANS_MAX_BLOCK         (G_MAXSIZE/2)
+
+/*
+ * One slot per standard exception class plus, at the end, the handler
+ * for exceptions without class.
+ */
+typedef struct {
+    CtransExceptionHandler handler;
+    gpointer               user_data;
+} CtransHandlerSlot;
+
+struct _CtransHandlerTable {
+    CtransHandlerSlot slots[CTRANS_EXCEPTION_CLASS_BITS + 1];
+};
+
+/*
+ * Per-thread library state. Finished transactions are kept in
+ * free_transactions (up to CTRANS_POOL_SIZE) together with their
+ * stack backup and sDebug buffers so the next NEWTRANSACTION in the
+ * same thread does not touch the heap.
+ */
+/*
+ * Statistics of the transactions started by one thread. Only the owner
+ * thread writes the counters, readers add up every shard. A transaction
+ * ended (or counted) by another thread, long-lived or run by a pool,
+ * goes to the counters of its name in the shard of that thread. Shards
+ * are never freed: when their thread exits they are handed to the next
+ * new thread, so Transaction.stats_name never dangles.
+ */
+typedef struct {
+    CtransStats  total;
+    GHashTable*  by_name;    // sDebug -> CtransStats*
+    GMutex       lock;       // taken by the owner to insert in by_name and by readers
+    gboolean     in_use;
+    const gchar* last_name;  // one entry cache of ctrans_stats_lookup
+    CtransStats* last_stats;
+    guint        timing_tick;
+} CtransStatsShard;
+
+typedef struct {
+    Transaction* free_transactions;
+    guint        n_free_transactions;
+    guint        last_id;            // ids are increasing inside a thread (see CtransSavepoint)
+    Transaction* current;            // innermost active transaction (linked by prev_current)
+    guint8*      side_stack;         // used to restore stack snapshots (see ctrans_jump_to_start)
+    ucontext_t   side_context;
+    Transaction* jump_trans;
+    gint         jump_state;
+    CtransStatsShard* stats;
+    CtransMapping*    mappings[CTRANS_MMAP_CACHE]; // released large blocks kept for reuse
+    guint             n_mappings;
+    GHashTable*       warm_arenas; // sDebug -> CtransWarmArena*
+    guint             warm_tick;
+    gint64            warm_clock;     // monotonic time, refreshed every CTRANS_WARM_ARENA_CLOCK_EVERY starts
+    gint64            warm_last_trim;
+} CtransThreadState;
+
+static void ctrans_thread_state_free (gpointer data);
+static GPrivate ctrans_thread_state = G_PRIVATE_INIT(ctrans_thread_state_free);
+
+/*
+ * Budgets. ctrans_n_name_budgets lets the start of a transaction skip
+ * the lookup while no name budget was ever set.
+ */
+static GRWLock     ctrans_budget_lock;     // protects ctrans_name_budgets
+static GHashTable* ctrans_name_budgets;    // sDebug -> max bytes
+static gint        ctrans_n_name_budgets;
+static gsize       ctrans_global_budget;
+static gsize       ctrans_global_bytes;    // used by the transactions with budget_global
+
+static void
+ctrans_destroy_transaction (Transaction* pTrans) 
+{
+    g_free(pTrans->stack_backup);
+    g_free(pTrans->sDebug);
+    g_free(pTrans->deferred_overflow);
+    g_free(pTrans->exception_text);
+    g_free(pTrans->undo_log);
+    g_free(pTrans);
+}
+
+static void
+ctrans_thread_state_free (gpointer data) 
+{
+    CtransThreadState* state = data;
+    while (state->free_transactions != NULL) 
+      {
+        Transaction* pTrans = state->free_transactions;
+        state->free_transactions = pTrans->next_free;
+        ctrans_destroy_transaction(pTrans);
+      }
+    g_free(state->side_stack);
+    while (state->n_mappings > 0) 
+      {
+        CtransMapping* mapping = state->mappings[--state->n_mappings];
+        munmap(mapping, mapping->length);
+      }
+    if (state->warm_arenas != NULL) 
+      {
+        g_hash_table_destroy(state->warm_arenas);
+      }
+    if (state->stats != NULL) 
+      {
+        state->stats->in_use = FALSE; // kept for readers and the next thread
+      }
+    g_free(state);
+}
+
+static CtransThreadState*
+ctrans_get_thread_state (void) 
+{
+    CtransThreadState* state = g_private_get(&ctrans_thread_state);
+    if (G_UNLIKELY(state == NULL)) 
+      {
+        state = g_malloc0(sizeof(CtransThreadState));
+        g_private_set(&ctrans_thread_state, state);
+      }
+    return state;
+}
+
+static void
+ctrans_warm_arena_drain (CtransWarmArena* warm) 
+{
+    while (warm->chunks != NULL) 
+      {
+        CtransArenaChunk* prev = warm->chunks->prev;
+        g_free(warm->chunks);
+        warm->chunks = prev;
+      }
+    warm->bytes = 0;
+}
+
+static void
+ctrans_warm_arena_destroy (gpointer data) 
+{
+    ctrans_warm_arena_drain(data);
+    g_free(data);
+}
+
+static void
+ctrans_warm_arena_trim_state (CtransThreadState* state, gint64 now, gint64 idle_us) 
+{
+    GHashTableIter iter;
+    gpointer warm;
+    g_hash_table_iter_init(&iter, state->warm_arenas);
+    while (g_hash_table_iter_next(&iter, NULL, &warm)) 
+      {
+        if (now - ((CtransWarmArena*)warm)->last_used >= idle_us) 
+          {
+            ctrans_warm_arena_drain(warm);
+          }
+      }
+}
+
+void
+ctrans_warm_arena_trim (gint64 idle_us) 
+{
+    CtransThreadState* state = ctrans_get_thread_state();
+    if (state->warm_arenas != NULL) 
+      {
+        ctrans_warm_arena_trim_state(state, g_get_monotonic_time(), idle_us);
+      }
+}
+
+/*
+ * Attaches to pTrans the chunks kept for its name. The clock is read
+ * once every CTRANS_WARM_ARENA_CLOCK_EVERY starts, and the names idle
+ * for CTRANS_WARM_ARENA_IDLE are trimmed at most that often.
+ */
+static void
+ctrans_warm_arena_start (CtransThreadState* state, Transaction* pTrans) 
+{
+    gpointer name, warm;
+    if (state->warm_tick++ % CTRANS_WARM_ARENA_CLOCK_EVERY == 0) 
+      {
+        state->warm_clock = g_get_monotonic_time();
+        if (state->warm_arenas == NULL) 
+          {
+            state->warm_arenas = g_hash_table_new_full(g_str_hash, g_str_equal, 
+                g_free, ctrans_warm_arena_destroy);
+            state->warm_last_trim = state->warm_clock;
+          }
+        else if (state->warm_clock - state->warm_last_trim >= CTRANS_WARM_ARENA_IDLE) 
+          {
+            ctrans_warm_arena_trim_state(state, state->warm_clock, CTRANS_WARM_ARENA_IDLE);
+            state->warm_last_trim = state->warm_clock;
+          }
+      }
+    if (!g_hash_table_lookup_extended(state->warm_arenas, pTrans->sDebug, &name, &warm)) 
+      {
+        warm = g_malloc0(sizeof(CtransWarmArena));
+        g_hash_table_insert(state->warm_arenas, g_strdup(pTrans->sDebug), warm);
+      }
+    ((CtransWarmArena*)warm)->last_used = state->warm_clock;
+    pTrans->warm = warm;
+}
+
+#ifndef CTRANS_NO_STATS
+
+static GMutex  ctrans_stats_lock;   // protects ctrans_stats_shards
+static GSList* ctrans_stats_shards;
+
+/*
+ * Adds n to a counter of the shard of the calling thread. It's the only
+ * writer, so a relaxed load and store are enough (no locked add), and
+ * readers loading it atomically never see a torn value, even for the
+ * 64 bits counters of 32 bits targets.
+ */
+#define CTRANS_STATS_BUMP(counter, n) \
+    __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), \
+        __ATOMIC_RELAXED)
+
+static gint64
+ctrans_now_ns (void) 
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (gint64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static inline guint
+ctrans_stats_bucket (guint64 value) 
+{
+    if (value == 0) return 0;
+    return MIN(g_bit_storage(value), CTRANS_STATS_BUCKETS - 1);
+}
+
+static CtransStatsShard*
+ctrans_stats_shard (CtransThreadState* state) 
+{
+    GSList* link;
+    if (G_LIKELY(state->stats != NULL)) return state->stats;
+    g_mutex_lock(&ctrans_stats_lock);
+    for (link = ctrans_stats_shards; link != NULL; link = link->next) 
+      {
+        CtransStatsShard* shard = link->data;
+        if (!shard->in_use) 
+          {
+            state->stats = shard;
+            break;
+          }
+      }
+    if (state->stats == NULL) 
+      {
+        state->stats = g_malloc0(sizeof(CtransStatsShard));
+        state->stats->by_name = g_hash_table_new(g_str_hash, g_str_equal);
+        g_mutex_init(&state->stats->lock);
+        ctrans_stats_shards = g_slist_prepend(ctrans_stats_shards, state->stats);
+      }
+    state->stats->in_use = TRUE;
+    g_mutex_unlock(&ctrans_stats_lock);
+    return state->stats;
+}
+
+/*
+ * Counters of the transactions named sDebug in shard. Transactions of
+ * the same name are usually started in a row, hence the cache.
+ */
+static CtransStats*
+ctrans_stats_lookup (CtransStatsShard* shard, const gchar* sDebug) 
+{
+    gpointer name, stats;
+    if (shard->last_name != NULL && strcmp(shard->last_name, sDebug) == 0) 
+      {
+        return shard->last_stats;
+      }
+    if (!g_hash_table_lookup_extended(shard->by_name, sDebug, &name, &stats)) 
+      {
+        name  = g_strdup(sDebug);
+        stats = g_malloc0(sizeof(CtransStats));
+        g_mutex_lock(&shard->lock);
+        g_hash_table_insert(shard->by_name, name, stats);
+        g_mutex_unlock(&shard->lock);
+      }
+    shard->last_name  = name;
+    shard->last_stats = stats;
+    return stats;
+}
+
+static void
+ctrans_stats_start (CtransThreadState* state, Transaction* pTrans) 
+{
+    CtransStatsShard* shard = ctrans_stats_shard(state);
+    pTrans->stats_shard = shard;
+    pTrans->stats_name  = ctrans_stats_lookup(shard, pTrans->sDebug);
+    CTRANS_STATS_BUMP(pTrans->stats_name->started, 1);
+    CTRANS_STATS_BUMP(shard->total.started, 1);
+    // Reading the clock costs as much as starting a transaction: sample
+    pTrans->start_ns = (++shard->timing_tick % CTRANS_STATS_TIMING_SAMPLE == 0) ? 
+        ctrans_now_ns() : 0;
+}
+
+/*
+ * Counters of the name of pTrans that the calling thread, owning shard,
+ * may write.
+ */
+static inline CtransStats*
+ctrans_stats_of (Transaction* pTrans, CtransStatsShard* shard) 
+{
+    if (G_LIKELY(shard == pTrans->stats_shard)) return pTrans->stats_name;
+    return ctrans_stats_lookup(shard, pTrans->sDebug);
+}
+
+static void
+ctrans_stats_end (Transaction* pTrans, gboolean bCommitted) 
+{
+    CtransStatsShard* shard = ctrans_stats_shard(ctrans_get_thread_state());
+    CtransStats* all[2] = { &shard->total, ctrans_stats_of(pTrans, shard) };
+    guint64 duration = 0;
+    int idx;
+    if (pTrans->start_ns != 0) 
+      {
+        duration = ctrans_now_ns() - pTrans->start_ns;
+      }
+    for (idx = 0; idx < 2; idx++) 
+      {
+        if (bCommitted) CTRANS_STATS_BUMP(all[idx]->committed, 1);
+        else            CTRANS_STATS_BUMP(all[idx]->rolled_back, 1);
+        if (pTrans->start_ns != 0) 
+          {
+            CTRANS_STATS_BUMP(all[idx]->timed, 1);
+            CTRANS_STATS_BUMP(all[idx]->duration_ns, duration);
+            CTRANS_STATS_BUMP(all[idx]->duration_hist[ctrans_stats_bucket(duration)], 1);
+          }
+      }
+}
+
+#define CTRANS_STATS_ADD(pTrans, field, n) \
+    do { \
+        CtransStatsShard* shard_ = ctrans_stats_shard(ctrans_get_thread_state()); \
+        CTRANS_STATS_BUMP(shard_->total.field, (n)); \
+        CTRANS_STATS_BUMP(ctrans_stats_of(pTrans, shard_)->field, (n)); \
+    } while (0)
+
+#else
+
+#define ctrans_stats_start(state, pTrans)
+#define ctrans_stats_end(pTrans, bCommitted)
+#define CTRANS_STATS_ADD(pTrans, field, n)
+
+#endif
+
+/*
+ * Pops a transaction from the thread pool or allocates a new one.
+ */
+static Transaction*
+ctrans_acquire_transaction (void) 
+{
+    CtransThreadState* state = ctrans_get_thread_state();
+    Transaction* pTrans = state->free_transactions;
+    if (pTrans != NULL) 
+      {
+        state->free_transactions = pTrans->next_free;
+        state->n_free_transactions--;
+      }
+    else
+      {
+        pTrans = g_try_malloc0(sizeof(Transaction));
+        if (pTrans == NULL) return NULL;
+      }
+    pTrans->id = ++state->last_id;
+    return pTrans;
+}
+
+/*
+ * Removes pTrans from the children of its parent. Children end in
+ * reverse order of creation, so it's normally the head of the list.
+ */
+static void
+ctrans_unlink_child (Transaction* pTrans) 
+{
+    Transaction** link;
+    if (pTrans->parent == NULL) return;
+    link = &pTrans->parent->children;
+    while (*link != pTrans) 
+      {
+        link = &(*link)->next_sibling;
+      }
+    *link = pTrans->next_sibling;
+    pTrans->parent       = NULL;
+    pTrans->next_sibling = NULL;
+}
+
+/*
+ * Removes pTrans from the stack of active transactions of the thread.
+ * It's normally the innermost one.
+ */
+static void
+ctrans_pop_current (CtransThreadState* state, Transaction* pTrans) 
+{
+    Transaction** link = &state->current;
+    while (*link != NULL && *link != pTrans) 
+      {
+        link = &(*link)->prev_current;
+      }
+    if (*link != NULL) 
+      {
+        *link = pTrans->prev_current;
+      }
+    pTrans->prev_current = NULL;
+}
+
+/*
+ * Ends every transaction started in this thread on top of mark and
+ * still active. They are abandoned when a jump goes past their frames.
+ * Long-lived transactions resumed on top of mark are just suspended.
+ */
+static void
+ctrans_unwind_current (CtransThreadState* state, Transaction* mark) 
+{
+    while (state->current != NULL && state->current != mark) 
+      {
+        Transaction* inner = state->current;
+        if (inner->flags & CTRANS_LONG_LIVED) 
+          {
+            // It outlives the frames being abandoned
+            ctrans_pop_current(state, inner);
+            inner->resumed = FALSE;
+            continue;
+          }
+        ctrans_stats_end(inner, FALSE);
+        ctrans_free_resources(inner);
+        ctrans_release_transaction(inner);
+      }
+}
+
+void
+ctrans_release_transaction (Transaction* pTrans) 
+{
+    CtransThreadState* state = ctrans_get_thread_state();
+    CTRANS_PROBE2(release, pTrans->id, pTrans->sDebug);
+    ctrans_pop_current(state, pTrans);
+    ctrans_unlink_child(pTrans);
+    if (state->n_free_transactions >= CTRANS_POOL_SIZE) 
+      {
+        ctrans_destroy_transaction(pTrans);
+        return;
+      }
+    pTrans->next_free = state->free_transactions;
+    state->free_transactions = pTrans;
+    state->n_free_transactions++;
+}
+
+/*
+ * Copies sDebug into the (recycled) name buffer of the transaction.
+ */
+static void
+ctrans_set_debug_name (Transaction* pTrans, const gchar* sDebug) 
+{
+    gsize len = (sDebug == NULL) ? 0 : strlen(sDebug);
+    if (pTrans->sDebug == NULL || pTrans->sDebug_capacity < len + 1) 
+      {
+        g_free(pTrans->sDebug);
+        pTrans->sDebug_capacity = MAX(len + 1, 32);
+        pTrans->sDebug = g_malloc(pTrans->sDebug_capacity);
+      }
+    memcpy(pTrans->sDebug, (sDebug == NULL) ? "" : sDebug, len + 1);
+}
+
 void
 ctrans_backup_Stack(guint32* stack_ptr2Top, Transaction* pTrans,guint32 *p2Stk) 
 {
-    guint32 stackBotton;
+    // The stack grows down: p2Stk, in our caller, is below stack_ptr2Top
+    gsize stack_size = (gsize)(stack_ptr2Top - p2Stk);
+    gsize idx;
     pTrans->stack_ptr2Top = stack_ptr2Top;
-    int stack_size           = pTrans->stack_ptr2Top - p2Stk;
-    pTrans->stack_backup  = (guint32 *)g_malloc(stack_size*sizeof(guint32));
+    if (pTrans->stack_backup == NULL || pTrans->stack_capacity < stack_size) 
+      {
+        g_free(pTrans->stack_backup);
+        pTrans->stack_backup   = (guint32 *)g_malloc(stack_size*sizeof(guint32));
+        pTrans->stack_capacity = stack_size;
+      }
     pTrans->stack_size    = stack_size;
-    int idx;
     for (idx = 0; idx<stack_size; ++idx) 
       {
-         pTrans->stack_backup[idx] = pTrans->stack_ptr2Top[-idx];
+         pTrans->stack_backup[idx] = pTrans->stack_ptr2Top[-idx];
+      }
+}
+
+void
+ctrans_restore_Stack(Transaction* pTrans)
+{ 
+    // TODO(1): Implementation depends on CPU architecture. 
+    //          Next code work just for x86 (stack growing down in memory).
+    gsize idx;
+    for (idx = 0; idx<pTrans->stack_size; ++idx) 
+      {
+        pTrans->stack_ptr2Top[-idx] = pTrans->stack_backup[idx]; 
+      }
+}
+
+
+gint
+ctrans_new_transaction (guint32* stack_ptr2Top, Transaction** ppTrans, 
+    Transaction* pParentTrans, gchar* sDebug) 
+{
+    return ctrans_new_transaction_full(stack_ptr2Top, ppTrans, pParentTrans, 
+        sDebug, CTRANS_DEFAULT);
+}
+
+/*
+ * Resets a transaction taken from the pool and links it to its parent.
+ */
+static void
+ctrans_init_transaction (Transaction* pTrans, Transaction* pParentTrans, 
+    gchar* sDebug, guint flags) 
+{
+    CtransThreadState* state = ctrans_get_thread_state();
+    if (flags & CTRANS_WARM_ARENA) 
+      {
+        flags |= CTRANS_ALLOC_ARENA;
+      }
+    pTrans->flags              = flags ;
+    pTrans->allocated_memory   = 0 ;
+    pTrans->last_block_seq     = 0 ;
+    pTrans->arena              = 0 ;
+    pTrans->warm               = 0 ;
+    pTrans->n_deferred         = 0 ;
+    pTrans->undo_used          = 0 ;
+    pTrans->n_prepare          = 0 ;
+    pTrans->stm                = 0 ;
+    pTrans->children           = 0 ;
+    pTrans->savepoint          = 0 ;
+    pTrans->parent             = pParentTrans ;
+    pTrans->next_sibling       = 0 ;
+    pTrans->handlers           = 0 ;
+    pTrans->fun_stop           = 0 ;
+    pTrans->fun_exc            = 0 ;
+    pTrans->resumed            = FALSE ;
+    if (pParentTrans != 0) 
+      {
+        pTrans->handlers         = (*pParentTrans).handlers;
+        pTrans->next_sibling     = (*pParentTrans).children;
+        (*pParentTrans).children = pTrans;
+      }
+    ctrans_set_debug_name(pTrans, sDebug);
+    pTrans->raisedException = 0 ;
+    pTrans->bytes_used      = 0 ;
+    pTrans->byte_budget     = 0 ;
+    pTrans->budget_global   = (ctrans_global_budget != 0);
+    if (g_atomic_int_get(&ctrans_n_name_budgets) > 0) 
+      {
+        g_rw_lock_reader_lock(&ctrans_budget_lock);
+        pTrans->byte_budget = GPOINTER_TO_SIZE(g_hash_table_lookup(ctrans_name_budgets, 
+            pTrans->sDebug));
+        g_rw_lock_reader_unlock(&ctrans_budget_lock);
+      }
+    // Long-lived transactions may end in another thread: not worth it
+    if ((flags & CTRANS_WARM_ARENA) && !(flags & CTRANS_LONG_LIVED)) 
+      {
+        ctrans_warm_arena_start(state, pTrans);
+      }
+    ctrans_stats_start(state, pTrans);
+}
+
+gint
+ctrans_new_transaction_full (guint32* stack_ptr2Top, Transaction** ppTrans, 
+    Transaction* pParentTrans, gchar* sDebug, guint flags) 
+{
+    guint32 ptr2stackBotton;
+    CTRANS_PROBE2(new, sDebug, flags);
+    *ppTrans = ctrans_acquire_transaction();
+    if (*ppTrans == NULL) 
+      {
+        g_print("CRITICAL: Unable to allocate memory. Exiting now");
+        exit(1);
+      }
+    if (flags & CTRANS_STACK_SNAPSHOT) 
+      {
+        ctrans_backup_Stack(stack_ptr2Top, *ppTrans, &ptr2stackBotton);
+      }
+    else
+      {
+        (*ppTrans)->stack_ptr2Top = stack_ptr2Top;
+        (*ppTrans)->stack_size    = 0;
+      }
+    ctrans_init_transaction(*ppTrans, pParentTrans, sDebug, flags & ~CTRANS_LONG_LIVED);
+    if (flags & CTRANS_STACK_SNAPSHOT) 
+      {
+        CTRANS_STATS_ADD(*ppTrans, stack_backup_hist[
+            ctrans_stats_bucket((*ppTrans)->stack_size*sizeof(guint32))], 1);
+      }
+    CtransThreadState* state = ctrans_get_thread_state();
+    (*ppTrans)->prev_current = state->current;
+    state->current           = *ppTrans;
+    CTRANS_PROBE3(start, (*ppTrans)->id, (*ppTrans)->sDebug, flags);
+    return TRANS_START;
+}
+
+void
+ctrans_new_long_transaction (Transaction** ppTrans, gchar* sDebug, guint flags, 
+    CtransTransactionFunc fun_stop, CtransTransactionFunc fun_exc) 
+{
+    *ppTrans = ctrans_acquire_transaction();
+    if (*ppTrans == NULL) 
+      {
+        g_print("CRITICAL: Unable to allocate memory. Exiting now");
+        exit(1);
+      }
+    (*ppTrans)->stack_ptr2Top = 0;
+    (*ppTrans)->stack_size    = 0;
+    flags = (flags & ~CTRANS_STACK_SNAPSHOT) | CTRANS_LONG_LIVED;
+    ctrans_init_transaction(*ppTrans, 0, sDebug, flags);
+    (*ppTrans)->fun_stop = fun_stop;
+    (*ppTrans)->fun_exc  = fun_exc;
+}
+
+void
+ctrans_resume_transaction (Transaction* pTrans) 
+{
+    CtransThreadState* state = ctrans_get_thread_state();
+    g_return_if_fail(!pTrans->resumed);
+    pTrans->resumed      = TRUE;
+    pTrans->prev_current = state->current;
+    state->current       = pTrans;
+}
+
+void
+ctrans_suspend_transaction (Transaction* pTrans) 
+{
+    CtransThreadState* state = ctrans_get_thread_state();
+    g_return_if_fail(pTrans->resumed);
+    ctrans_unwind_current(state, pTrans);
+    ctrans_pop_current(state, pTrans);
+    pTrans->resumed = FALSE;
+}
+
+/*
+ * Bump allocation inside the transaction region. A new chunk is
+ * only requested when the current one can not hold n_bytes.
+ * Returns NULL if the system is out of memory.
+ */
+static gpointer
+ctrans_arena_alloc (Transaction* pTrans, gsize n_bytes) 
+{
+    CtransArenaChunk* chunk = pTrans->arena;
+    gpointer result;
+    if (n_bytes > G_MAXSIZE - CTRANS_ARENA_CHUNK_SIZE) 
+      {
+        return NULL;
+      }
+    n_bytes = CTRANS_ALIGN_UP(n_bytes);
+    if (chunk == NULL || chunk->size - chunk->used < n_bytes) 
+      {
+        gsize size = MAX(CTRANS_ARENA_CHUNK_SIZE - CTRANS_ARENA_HEADER, n_bytes);
+        CtransWarmArena* warm = pTrans->warm;
+        CtransArenaChunk* newChunk;
+        if (warm != NULL && warm->chunks != NULL && warm->chunks->size >= size) 
+          {
+            newChunk     = warm->chunks;
+            warm->chunks = newChunk->prev;
+            warm->bytes -= newChunk->size;
+          }
+        else
+          {
+            newChunk = g_try_malloc(CTRANS_ARENA_HEADER + size);
+            if (newChunk == NULL) return NULL;
+            newChunk->size = size;
+          }
+        newChunk->prev = chunk;
+        newChunk->used = 0;
+        pTrans->arena  = newChunk;
+        chunk          = newChunk;
+      }
+    result = (guint8*)chunk + CTRANS_ARENA_HEADER + chunk->used;
+    chunk->used += n_bytes;
+    return result;
+}
+
+/*
+ * Charges n_bytes to the budgets of pTrans. Returns FALSE, charging
+ * nothing, if one of them would be exceeded.
+ */
+static gboolean
+ctrans_budget_charge (Transaction* pTrans, gsize n_bytes) 
+{
+    if (pTrans->byte_budget != 0 && 
+        (n_bytes > pTrans->byte_budget || pTrans->bytes_used > pTrans->byte_budget - n_bytes)) 
+      {
+        return FALSE;
+      }
+    if (pTrans->budget_global) 
+      {
+        gsize before = g_atomic_pointer_add(&ctrans_global_bytes, n_bytes);
+        gsize budget = ctrans_global_budget;
+        if (budget != 0 && (before + n_bytes > budget || before + n_bytes < before)) 
+          {
+            g_atomic_pointer_add(&ctrans_global_bytes, -(gssize)n_bytes);
+            return FALSE;
+          }
+      }
+    pTrans->bytes_used += n_bytes;
+    return TRUE;
+}
+
+/*
+ * Gives back to the budgets everything over bytes_used. It never
+ * grows: blocks freed inside a savepoint may leave bytes_used below
+ * the value recorded by the savepoint.
+ */
+static void
+ctrans_budget_uncharge (Transaction* pTrans, gsize bytes_used) 
+{
+    if (pTrans->bytes_used <= bytes_used) return;
+    if (pTrans->budget_global) 
+      {
+        g_atomic_pointer_add(&ctrans_global_bytes, -(gssize)(pTrans->bytes_used - bytes_used));
+      }
+    pTrans->bytes_used = bytes_used;
+}
+
+static gsize
+ctrans_mapping_length (gsize n_bytes) 
+{
+    static gsize page_size;
+    if (page_size == 0) page_size = sysconf(_SC_PAGESIZE);
+    return (CTRANS_MAP_HEADER + CTRANS_HEAP_HEADER + n_bytes + page_size - 1) & ~(page_size - 1);
+}
+
+/*
+ * Returns a mapping able to hold a heap block of n_bytes. The smallest
+ * cached mapping that fits without wasting more than half of it is
+ * reused, otherwise a new one is mapped.
+ */
+static CtransHeapBlock*
+ctrans_mapping_alloc (Transaction* pTrans, gsize n_bytes) 
+{
+    CtransThreadState* state = ctrans_get_thread_state();
+    gsize length = ctrans_mapping_length(n_bytes);
+    CtransMapping* mapping;
+    guint idx, best = CTRANS_MMAP_CACHE;
+    for (idx = 0; idx < state->n_mappings; idx++) 
+      {
+        gsize cached = state->mappings[idx]->length;
+        if (cached >= length && cached / 2 <= length && 
+            (best == CTRANS_MMAP_CACHE || cached < state->mappings[best]->length)) 
+          {
+            best = idx;
+          }
+      }
+    if (best != CTRANS_MMAP_CACHE) 
+      {
+        mapping = state->mappings[best];
+        state->mappings[best] = state->mappings[--state->n_mappings];
+        return CTRANS_MAPPING_HEAP(mapping);
+      }
+    mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) return NULL;
+    mapping->length = length;
+#ifdef MADV_HUGEPAGE
+    if ((pTrans->flags & CTRANS_HUGE_PAGES) && length >= CTRANS_HUGE_PAGE_SIZE) 
+      {
+        madvise(mapping, length, MADV_HUGEPAGE);
+      }
+#endif
+    return CTRANS_MAPPING_HEAP(mapping);
+}
+
+/*
+ * Unmaps the mapping of heap, or keeps it in the thread cache without
+ * its pages (the first one holds the header and is kept).
+ */
+static void
+ctrans_mapping_free (CtransHeapBlock* heap) 
+{
+    CtransThreadState* state = ctrans_get_thread_state();
+    CtransMapping* mapping = CTRANS_HEAP_MAPPING(heap);
+    if (state->n_mappings < CTRANS_MMAP_CACHE && mapping->length <= CTRANS_MMAP_CACHE_MAX) 
+      {
+        gsize page_size = sysconf(_SC_PAGESIZE);
+        madvise((guint8*)mapping + page_size, mapping->length - page_size, MADV_DONTNEED);
+        state->mappings[state->n_mappings++] = mapping;
+        return;
+      }
+    munmap(mapping, mapping->length);
+}
+
+static void
+ctrans_heap_block_free (CtransHeapBlock* heap) 
+{
+    if (CTRANS_BLOCK_MAPPED(&heap->block)) 
+      {
+        ctrans_mapping_free(heap);
+      }
+    else
+      {
+        g_free(heap);
+      }
+}
+
+/*
+ * Allocates a block of n_bytes (header not included) without any
+ * accounting. Returns NULL if the system is out of memory.
+ */
+static gpointer
+ctrans_block_alloc (Transaction* pTrans, gsize n_bytes) 
+{
+    CtransBlock* block;
+    if ((pTrans->flags & CTRANS_ALLOC_ARENA) && n_bytes < CTRANS_MMAP_THRESHOLD) 
+      {
+        block = ctrans_arena_alloc(pTrans, CTRANS_BLOCK_HEADER + n_bytes);
+        if (block == NULL) return NULL;
+        block->seq = 0;
+      }
+    else
+      {
+        CtransHeapBlock* heap = (n_bytes >= CTRANS_MMAP_THRESHOLD) ? 
+            ctrans_mapping_alloc(pTrans, n_bytes) : 
+            g_try_malloc(CTRANS_HEAP_HEADER + n_bytes);
+        if (heap == NULL) return NULL;
+        heap->prev = pTrans->allocated_memory;
+        heap->next = NULL;
+        if (heap->prev != NULL) heap->prev->next = heap;
+        pTrans->allocated_memory = heap;
+        block = &heap->block;
+        block->seq = ++pTrans->last_block_seq;
+      }
+    block->size = n_bytes;
+    return CTRANS_BLOCK_DATA(block);
+}
+
+/*
+ * Common failure path of the allocators.
+ */
+static gpointer
+ctrans_alloc_failed (Transaction* pTrans, gboolean bBudget, gboolean bRaiseException) 
+{
+    if (bRaiseException==FALSE) return NULL;
+    if (bBudget) 
+      {
+        ctrans_raise_sender_exception(pTrans, CTRANS_BUDGET_EXCEEDED, 
+            "memory budget exceeded @ ctrans_try_malloc", pTrans->sDebug) ;
+        return NULL; // a handler resumed the exception
+      }
+    // If NULL is not allowed raise an administratorException
+    // TODO(0): This is not "very legal" for a library, but enough for a first draft.
+    // It could be caused by a programming mistake with an n_bytes non-sense value.
+    // Change for a senderException.
+    ctrans_raise_sender_exception(pTrans, NO_RESOURCE_AVAILABLE, "g_try_malloc failed @ ctrans_try_malloc", "") ;
+    return NULL; // a handler resumed the exception
+}
+
+gpointer
+ctrans_try_malloc (Transaction* pTrans, gsize n_bytes, gboolean bRaiseException) 
+{
+    gpointer result;
+    if (n_bytes > CTRANS_MAX_BLOCK) 
+      {
+        return ctrans_alloc_failed(pTrans, FALSE, bRaiseException);
+      }
+    if (!ctrans_budget_charge(pTrans, n_bytes)) 
+      {
+        return ctrans_alloc_failed(pTrans, TRUE, bRaiseException);
+      }
+    result = ctrans_block_alloc(pTrans, n_bytes);
+    if (!result) 
+      {
+        ctrans_budget_uncharge(pTrans, pTrans->bytes_used - n_bytes);
+        return ctrans_alloc_failed(pTrans, FALSE, bRaiseException);
+      }
+    CTRANS_STATS_ADD(pTrans, allocs, 1);
+    CTRANS_STATS_ADD(pTrans, alloc_bytes, n_bytes);
+    CTRANS_PROBE4(malloc, pTrans->id, pTrans->sDebug, n_bytes, result);
+    return result;
+}
+
+gpointer
+ctrans_try_calloc (Transaction* pTrans, gsize n_blocks, gsize n_block_bytes, 
+    gboolean bRaiseException) 
+{
+    gpointer result;
+    if (n_block_bytes != 0 && n_blocks > CTRANS_MAX_BLOCK / n_block_bytes) 
+      {
+        return ctrans_alloc_failed(pTrans, FALSE, bRaiseException);
+      }
+    result = ctrans_try_malloc(pTrans, n_blocks * n_block_bytes, bRaiseException);
+    if (result != NULL) 
+      {
+        memset(result, 0, n_blocks * n_block_bytes);
+      }
+    return result;
+}
+
+/*
+ * TRUE if block is the last one allocated by pTrans and no savepoint
+ * was pushed since (rolling back to it would cut the block back to its
+ * old size), so it can be resized in place.
+ */
+static gboolean
+ctrans_block_is_newest (Transaction* pTrans, CtransBlock* block) 
+{
+    CtransSavepoint* pSavepoint = pTrans->savepoint;
+    if (!CTRANS_BLOCK_IN_HEAP(pTrans, block)) 
+      {
+        CtransArenaChunk* chunk = pTrans->arena;
+        guint8* data = (guint8*)chunk + CTRANS_ARENA_HEADER;
+        if ((guint8*)block + CTRANS_BLOCK_HEADER + CTRANS_ALIGN_UP(block->size) != 
+                data + chunk->used) 
+          {
+            return FALSE;
+          }
+        return pSavepoint == NULL || pSavepoint->arena != chunk || 
+            (guint8*)block >= data + pSavepoint->arena_used;
+      }
+    return pTrans->allocated_memory == CTRANS_HEAP_BLOCK(block) && 
+        (pSavepoint == NULL || block->seq > pSavepoint->block_seq);
+}
+
+/*
+ * Links heap, just moved by a realloc, back in allocated_memory.
+ */
+static void
+ctrans_heap_block_relink (Transaction* pTrans, CtransHeapBlock* heap) 
+{
+    if (heap->prev != NULL) heap->prev->next = heap;
+    if (heap->next != NULL) heap->next->prev = heap;
+    else                    pTrans->allocated_memory = heap;
+}
+
+/*
+ * Grows block in place: the newest block of the arena, or any heap
+ * block through g_try_realloc or mremap (it keeps its place in
+ * allocated_memory). Budget already charged. Returns NULL if that's not
+ * possible, also when the block would cross CTRANS_MMAP_THRESHOLD.
+ */
+static gpointer
+ctrans_block_grow (Transaction* pTrans, CtransBlock* block, gsize n_bytes) 
+{
+    CtransHeapBlock* heap;
+    if (!CTRANS_BLOCK_MAPPED(block) && n_bytes >= CTRANS_MMAP_THRESHOLD) 
+      {
+        return NULL;
+      }
+    if (!CTRANS_BLOCK_IN_HEAP(pTrans, block)) 
+      {
+        CtransArenaChunk* chunk = pTrans->arena;
+        gsize extra = CTRANS_ALIGN_UP(n_bytes) - CTRANS_ALIGN_UP(block->size);
+        if (chunk->size - chunk->used < extra) return NULL;
+        chunk->used += extra;
+        block->size = n_bytes;
+        return CTRANS_BLOCK_DATA(block);
+      }
+    if (CTRANS_BLOCK_MAPPED(block)) 
+      {
+        CtransMapping* mapping = CTRANS_HEAP_MAPPING(CTRANS_HEAP_BLOCK(block));
+        gsize length = ctrans_mapping_length(n_bytes);
+        if (length > mapping->length) 
+          {
+#ifdef MREMAP_MAYMOVE
+            mapping = mremap(mapping, mapping->length, length, MREMAP_MAYMOVE);
+            if (mapping == MAP_FAILED) return NULL;
+            mapping->length = length;
+#else
+            return NULL;
+#endif
+          }
+        heap = CTRANS_MAPPING_HEAP(mapping);
+      }
+    else
+      {
+        heap = g_try_realloc(CTRANS_HEAP_BLOCK(block), CTRANS_HEAP_HEADER + n_bytes);
+        if (heap == NULL) return NULL;
+      }
+    ctrans_heap_block_relink(pTrans, heap);
+    heap->block.size = n_bytes;
+    return CTRANS_BLOCK_DATA(&heap->block);
+}
+
+/*
+ * Shrinks block to n_bytes and gives the difference back to the
+ * budget. Returns its data, which may have moved: a mapped block that
+ * no longer needs a mapping is copied to a smaller block. An arena
+ * block that isn't the newest is kept as is until the end.
+ */
+static gpointer
+ctrans_block_shrink (Transaction* pTrans, CtransBlock* block, gsize n_bytes) 
+{
+    gsize freed = block->size - n_bytes;
+    if (!CTRANS_BLOCK_IN_HEAP(pTrans, block)) 
+      {
+        if (!ctrans_block_is_newest(pTrans, block)) return CTRANS_BLOCK_DATA(block);
+        // Give the tail back to the arena
+        pTrans->arena->used -= CTRANS_ALIGN_UP(block->size) - CTRANS_ALIGN_UP(n_bytes);
+      }
+    else if (CTRANS_BLOCK_MAPPED(block)) 
+      {
+        if (n_bytes < CTRANS_MMAP_THRESHOLD) 
+          {
+            gpointer result = ctrans_try_malloc(pTrans, n_bytes, FALSE);
+            if (result == NULL) return CTRANS_BLOCK_DATA(block);
+            memcpy(result, CTRANS_BLOCK_DATA(block), n_bytes);
+            ctrans_free(pTrans, CTRANS_BLOCK_DATA(block));
+            return result;
+          }
+      }
+    else
+      {
+        CtransHeapBlock* heap = g_try_realloc(CTRANS_HEAP_BLOCK(block), CTRANS_HEAP_HEADER + n_bytes);
+        if (heap == NULL) return CTRANS_BLOCK_DATA(block);
+        ctrans_heap_block_relink(pTrans, heap);
+        block = &heap->block;
+      }
+    block->size = n_bytes;
+    ctrans_budget_uncharge(pTrans, (pTrans->bytes_used > freed) ? pTrans->bytes_used - freed : 0);
+    return CTRANS_BLOCK_DATA(block);
+}
+
+gpointer
+ctrans_try_realloc (Transaction* pTrans, gpointer mem, gsize n_bytes, 
+    gboolean bRaiseException) 
+{
+    CtransBlock* block;
+    gpointer result;
+    if (mem == NULL) 
+      {
+        return ctrans_try_malloc(pTrans, n_bytes, bRaiseException);
+      }
+    block = CTRANS_DATA_BLOCK(mem);
+    if (n_bytes <= block->size) 
+      {
+        return ctrans_block_shrink(pTrans, block, n_bytes);
+      }
+    if (n_bytes > CTRANS_MAX_BLOCK) 
+      {
+        return ctrans_alloc_failed(pTrans, FALSE, bRaiseException);
+      }
+    if (CTRANS_BLOCK_IN_HEAP(pTrans, block) || ctrans_block_is_newest(pTrans, block)) 
+      {
+        gsize grow = n_bytes - block->size;
+        if (!ctrans_budget_charge(pTrans, grow)) 
+          {
+            return ctrans_alloc_failed(pTrans, TRUE, bRaiseException);
+          }
+        result = ctrans_block_grow(pTrans, block, n_bytes);
+        if (result != NULL) 
+          {
+            CTRANS_STATS_ADD(pTrans, alloc_bytes, grow);
+            return result;
+          }
+        ctrans_budget_uncharge(pTrans, pTrans->bytes_used - grow);
+      }
+    result = ctrans_try_malloc(pTrans, n_bytes, bRaiseException);
+    if (result != NULL) 
+      {
+        memcpy(result, mem, block->size);
+        ctrans_free(pTrans, mem); // an older arena block stays until the end
+      }
+    return result;
+}
+
+void
+ctrans_free (Transaction* pTrans, gpointer mem) 
+{
+    CtransBlock* block;
+    if (mem == NULL) return;
+    block = CTRANS_DATA_BLOCK(mem);
+    if (!CTRANS_BLOCK_IN_HEAP(pTrans, block)) 
+      {
+        if (!ctrans_block_is_newest(pTrans, block)) return; // kept until the end
+        pTrans->arena->used -= CTRANS_BLOCK_HEADER + CTRANS_ALIGN_UP(block->size);
+      }
+    else
+      {
+        CtransHeapBlock* heap = CTRANS_HEAP_BLOCK(block);
+        if (heap->next != NULL) heap->next->prev = heap->prev;
+        else                    pTrans->allocated_memory = heap->prev;
+        if (heap->prev != NULL) heap->prev->next = heap->next;
+      }
+    ctrans_budget_uncharge(pTrans, (pTrans->bytes_used > block->size) ? 
+        pTrans->bytes_used - block->size : 0);
+    CTRANS_STATS_ADD(pTrans, frees, 1);
+    if (CTRANS_BLOCK_IN_HEAP(pTrans, block)) 
+      {
+        ctrans_heap_block_free(CTRANS_HEAP_BLOCK(block));
+      }
+}
+
+gchar*
+ctrans_strdup (Transaction* pTrans, const gchar* str) 
+{
+    gchar* copy;
+    gsize len;
+    if (str == NULL) return NULL;
+    len  = strlen(str);
+    copy = ctrans_try_malloc(pTrans, len + 1, TRUE);
+    if (copy != NULL) memcpy(copy, str, len + 1);
+    return copy;
+}
+
+gchar*
+ctrans_strndup (Transaction* pTrans, const gchar* str, gsize n) 
+{
+    gchar* copy;
+    gsize len;
+    if (str == NULL) return NULL;
+    len  = strnlen(str, n);
+    copy = ctrans_try_malloc(pTrans, len + 1, TRUE);
+    if (copy != NULL) 
+      {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+      }
+    return copy;
+}
+
+gchar*
+ctrans_strdup_vprintf (Transaction* pTrans, const gchar* format, va_list args) 
+{
+    gchar buffer[256]; // most strings are formatted just once, here
+    gchar* result;
+    va_list copy;
+    gint len;
+    va_copy(copy, args);
+    len = g_vsnprintf(buffer, sizeof(buffer), format, copy);
+    va_end(copy);
+    if (len < 0) 
+      {
+        ctrans_raise_sender_exception(pTrans, INVALID_ARGUMENT, 
+            "invalid format @ ctrans_strdup_vprintf", "") ;
+        return NULL;
+      }
+    result = ctrans_try_malloc(pTrans, len + 1, TRUE);
+    if (result == NULL) return NULL;
+    if (len < sizeof(buffer)) 
+      {
+        memcpy(result, buffer, len + 1);
+      }
+    else
+      {
+        g_vsnprintf(result, len + 1, format, args);
+      }
+    return result;
+}
+
+gchar*
+ctrans_strdup_printf (Transaction* pTrans, const gchar* format, ...) 
+{
+    gchar* result;
+    va_list args;
+    va_start(args, format);
+    result = ctrans_strdup_vprintf(pTrans, format, args);
+    va_end(args);
+    return result;
+}
+
+static void
+ctrans_undo_reserve (Transaction* pTrans, gsize n_bytes) 
+{
+    if (pTrans->undo_capacity - pTrans->undo_used < n_bytes) 
+      {
+        pTrans->undo_capacity = MAX(2 * pTrans->undo_capacity, pTrans->undo_used + n_bytes);
+        pTrans->undo_log      = g_realloc(pTrans->undo_log, pTrans->undo_capacity);
+      }
+}
+
+void
+ctrans_undo_save (Transaction* pTrans, gconstpointer dest, gsize n_bytes) 
+{
+    gsize size = CTRANS_UNDO_PAD(n_bytes) + sizeof(CtransUndoEntry);
+    gsize level = (pTrans->savepoint != 0) ? pTrans->savepoint->undo_used : 0;
+    CtransUndoEntry* last;
+    if (pTrans->undo_used > level) 
+      {
+        // The value before the first write is the one to restore
+        last = (CtransUndoEntry*)(pTrans->undo_log + pTrans->undo_used - sizeof(CtransUndoEntry));
+        if (last->dest == dest && last->n_bytes == n_bytes) return;
+      }
+    ctrans_undo_reserve(pTrans, size);
+    memcpy(pTrans->undo_log + pTrans->undo_used, dest, n_bytes);
+    pTrans->undo_used += size;
+    last = (CtransUndoEntry*)(pTrans->undo_log + pTrans->undo_used - sizeof(CtransUndoEntry));
+    last->dest    = (gpointer)dest;
+    last->n_bytes = n_bytes;
+}
+
+void
+ctrans_memcpy (Transaction* pTrans, gpointer dest, gconstpointer src, gsize n_bytes) 
+{
+    ctrans_undo_save(pTrans, dest, n_bytes);
+    memcpy(dest, src, n_bytes);
+}
+
+/*
+ * Writes back the old bytes logged since mark, newest first.
+ */
+static void
+ctrans_undo_replay (Transaction* pTrans, gsize mark) 
+{
+    while (pTrans->undo_used > mark) 
+      {
+        CtransUndoEntry* entry = (CtransUndoEntry*)(pTrans->undo_log + 
+            pTrans->undo_used - sizeof(CtransUndoEntry));
+        pTrans->undo_used -= CTRANS_UNDO_PAD(entry->n_bytes) + sizeof(CtransUndoEntry);
+        memcpy(entry->dest, pTrans->undo_log + pTrans->undo_used, entry->n_bytes);
+      }
+}
+
+/*
+ * Forgets the undo log of a committing transaction. A child hands it
+ * to its parent, whose rollback must still undo those writes.
+ */
+static void
+ctrans_undo_commit (Transaction* pTrans) 
+{
+    Transaction* parent = pTrans->parent;
+    if (pTrans->undo_used != 0 && parent != 0) 
+      {
+        ctrans_undo_reserve(parent, pTrans->undo_used);
+        memcpy(parent->undo_log + parent->undo_used, pTrans->undo_log, pTrans->undo_used);
+        parent->undo_used += pTrans->undo_used;
+      }
+    pTrans->undo_used = 0;
+}
+
+/*
+ * Releases every resource acquired after mark was taken: children
+ * transactions still running, writes in the undo log, tracked blocks
+ * and arena chunks. The arena is just cut back to the position
+ * recorded in mark.
+ */
+static void
+ctrans_release_since (Transaction* pTrans, const CtransSavepoint* mark) 
+{
+    ctrans_budget_uncharge(pTrans, mark->bytes_used);
+    while ((*pTrans).children != 0 && (*pTrans).children->id > mark->last_child_id) 
+      {
+        Transaction* child = (*pTrans).children;
+        ctrans_stats_end(child, FALSE);
+        ctrans_free_resources(child);
+        ctrans_release_transaction(child);
+      }
+    ctrans_undo_replay(pTrans, mark->undo_used);
+    while ((*pTrans).n_deferred > mark->n_deferred) 
+      {
+        guint idx = --(*pTrans).n_deferred;
+        CtransDeferred* entry = (idx < CTRANS_DEFER_INLINE) ? 
+            &(*pTrans).deferred_inline[idx] : 
+            &(*pTrans).deferred_overflow[idx - CTRANS_DEFER_INLINE];
+        entry->fn(entry->arg);
+      }
+    while ((*pTrans).allocated_memory != 0 && 
+           (*pTrans).allocated_memory->block.seq > mark->block_seq) 
+      {
+        CtransHeapBlock* heap = (*pTrans).allocated_memory;
+        (*pTrans).allocated_memory = heap->prev;
+        ctrans_heap_block_free(heap);
+      }
+    if ((*pTrans).allocated_memory != 0) 
+      {
+        (*pTrans).allocated_memory->next = 0;
+      }
+    while ((*pTrans).arena != mark->arena) 
+      {
+        CtransArenaChunk* chunk = (*pTrans).arena;
+        CtransWarmArena* warm = (*pTrans).warm;
+        (*pTrans).arena = chunk->prev;
+        if (warm != NULL && warm->bytes + chunk->size <= CTRANS_WARM_ARENA_MAX) 
+          {
+            chunk->prev  = warm->chunks;
+            warm->chunks = chunk;
+            warm->bytes += chunk->size;
+          }
+        else
+          {
+            g_free(chunk);
+          }
+      }
+    if ((*pTrans).arena != 0 ) 
+      {
+        (*pTrans).arena->used = mark->arena_used;
+      }
+}
+
+void
+ctrans_defer (Transaction* pTrans, CtransCleanupFunc fn, gpointer arg) 
+{
+    CtransDeferred* entry;
+    guint idx = pTrans->n_deferred;
+    if (idx < CTRANS_DEFER_INLINE) 
+      {
+        entry = &pTrans->deferred_inline[idx];
+      }
+    else
+      {
+        idx -= CTRANS_DEFER_INLINE;
+        if (idx >= pTrans->deferred_capacity) 
+          {
+            pTrans->deferred_capacity = MAX(2 * pTrans->deferred_capacity, CTRANS_DEFER_INLINE);
+            pTrans->deferred_overflow = g_realloc(pTrans->deferred_overflow, 
+                pTrans->deferred_capacity * sizeof(CtransDeferred));
+          }
+        entry = &pTrans->deferred_overflow[idx];
+      }
+    entry->fn  = fn;
+    entry->arg = arg;
+    pTrans->n_deferred++;
+}
+
+void
+ctrans_free_resources (Transaction* pTrans) 
+{
+    static const CtransSavepoint emptyMark; // nothing acquired yet
+    CTRANS_PROBE2(free_resources, pTrans->id, pTrans->sDebug);
+    ctrans_release_since(pTrans, &emptyMark);
+    (*pTrans).savepoint = 0;
+    (*pTrans).n_prepare = 0;
+}
+
+void
+ctrans_on_prepare (Transaction* pTrans, CtransPrepareFunc fn, gpointer arg) 
+{
+    if (pTrans->n_prepare == CTRANS_PREPARE_HOOKS) 
+      {
+        ctrans_raise_recipient_exception(pTrans, IMPLEMENTATION, "too many prepare hooks",
+            pTrans->sDebug, "raise CTRANS_PREPARE_HOOKS");
+        // resumed by a handler: committing without the hook is not an option
+        g_error("libctrans: %s: too many prepare hooks", pTrans->sDebug);
+      }
+    pTrans->prepare[pTrans->n_prepare].fn  = fn;
+    pTrans->prepare[pTrans->n_prepare].arg = arg;
+    pTrans->n_prepare++;
+}
+
+/*
+ * Runs the prepare hooks once. They may raise or restart. The hooks
+ * registered meanwhile run in a following round.
+ */
+static void
+ctrans_run_prepare (Transaction* pTrans) 
+{
+    CtransPrepareHook hooks[CTRANS_PREPARE_HOOKS];
+    guint idx, n_prepare;
+    while ((n_prepare = pTrans->n_prepare) > 0) 
+      {
+        memcpy(hooks, pTrans->prepare, n_prepare * sizeof(CtransPrepareHook));
+        pTrans->n_prepare = 0;
+        for (idx = 0; idx < n_prepare; idx++) 
+          {
+            hooks[idx].fn(pTrans, hooks[idx].arg);
+          }
+      }
+}
+
+
+void
+ctrans_savepoint_push (Transaction* pTrans, CtransSavepoint* pSavepoint) 
+{
+    pSavepoint->block_seq        = pTrans->last_block_seq;
+    pSavepoint->arena            = pTrans->arena;
+    pSavepoint->arena_used       = (pTrans->arena != 0) ? pTrans->arena->used : 0;
+    pSavepoint->n_deferred       = pTrans->n_deferred;
+    pSavepoint->bytes_used       = pTrans->bytes_used;
+    pSavepoint->undo_used        = pTrans->undo_used;
+    pSavepoint->last_child_id    = ctrans_get_thread_state()->last_id;
+    pSavepoint->current          = ctrans_get_thread_state()->current;
+    pSavepoint->prev             = pTrans->savepoint;
+    pTrans->savepoint            = pSavepoint;
+}
+
+void
+ctrans_savepoint_release (Transaction* pTrans, CtransSavepoint* pSavepoint) 
+{
+    pTrans->savepoint = pSavepoint->prev;
+}
+
+void
+ctrans_rollback_to_savepoint (Transaction* pTrans, CtransSavepoint* pSavepoint) 
+{
+    // Inner savepoints are discarded together with their resources
+    pTrans->savepoint = pSavepoint;
+    ctrans_release_since(pTrans, pSavepoint);
+    CTRANS_STATS_ADD(pTrans, savepoint_rollbacks, 1);
+}
+
+/*
+ * Copies the non NULL texts to one buffer (returned, g_free it) and
+ * points copies at them.
+ */
+static gchar*
+ctrans_copy_texts (const gchar* texts[3], gchar* copies[3]) 
+{
+    gsize lengths[3], total = 0;
+    gchar* buffer;
+    guint idx;
+    for (idx = 0; idx < 3; idx++) 
+      {
+        lengths[idx] = (texts[idx] != NULL) ? strlen(texts[idx]) + 1 : 0;
+        total += lengths[idx];
+      }
+    buffer = g_malloc(MAX(total, 1));
+    for (idx = 0, total = 0; idx < 3; idx++) 
+      {
+        copies[idx] = (texts[idx] != NULL) ? memcpy(buffer + total, texts[idx], lengths[idx]) : NULL;
+        total += lengths[idx];
+      }
+    return buffer;
+}
+
+typedef struct {
+    Transaction*        pTrans;
+    CtransRecordResult* result;
+    gchar*              texts; // copied by ctrans_record_capture, NULL if it didn't run
+} CtransRecordCapture;
+
+/*
+ * First cleanup of the savepoint of a record. Its rollback runs it
+ * before the memory of the record is released: the exception is
+ * formatted and copied to the result while its texts can be read.
+ */
+static void
+ctrans_record_capture (gpointer data) 
+{
+    CtransRecordCapture* capture = data;
+    exception_base* exception = capture->pTrans->raisedException;
+    const gchar* texts[3];
+    gchar* copies[3];
+    if (exception == NULL) return; // a restart
+    ctrans_format_exception(capture->pTrans, exception);
+    texts[0] = exception->description_i18n;
+    texts[1] = exception->detail_i18n;
+    texts[2] = ((const recipient_exception*)exception)->solution_i18n;
+    capture->texts = ctrans_copy_texts(texts, copies);
+    capture->result->exception.parent.parent = *exception;
+    capture->result->exception.parent.parent.description_i18n = copies[0];
+    capture->result->exception.parent.parent.detail_i18n      = copies[1];
+    capture->result->exception.solution_i18n                  = copies[2];
+}
+
+static void
+ctrans_record_nop (G_GNUC_UNUSED gpointer data) 
+{
+}
+
+/*
+ * Runs fn on a single record. The savepoint jump target lives in this
+ * frame, so a failing record leaves the caller loop untouched.
+ */
+static gboolean
+ctrans_process_one (Transaction* pTrans, gpointer record, CtransRecordFunc fn, 
+    gpointer user_data, CtransRecordResult* result) 
+{
+    CtransRecordCapture capture = { pTrans, result, NULL };
+    CtransSavepoint sp;
+    NEWSAVEPOINT(pTrans, sp) 
+      {
+        ctrans_defer(pTrans, ctrans_record_capture, &capture);
+        fn(pTrans, record, user_data);
+        // capture lives in this frame: drop its cleanup, or disarm it
+        // when fn registered others after it
+        if (pTrans->n_deferred == sp.n_deferred + 1) 
+          {
+            pTrans->n_deferred--;
+          }
+        else if (sp.n_deferred < CTRANS_DEFER_INLINE) 
+          {
+            pTrans->deferred_inline[sp.n_deferred].fn = ctrans_record_nop;
+          }
+        else
+          {
+            pTrans->deferred_overflow[sp.n_deferred - CTRANS_DEFER_INLINE].fn = ctrans_record_nop;
+          }
+        RELEASESAVEPOINT(pTrans, sp);
+        result->failed = FALSE;
+        return TRUE;
+      }
+    // The texts must outlive the rollback of the next records
+    if (capture.texts != NULL) ctrans_defer(pTrans, g_free, capture.texts);
+    result->failed = TRUE;
+    pTrans->raisedException = 0;
+    return FALSE;
+}
+
+CtransRecordResult*
+ctrans_process_records (Transaction* pTrans, gpointer records, gsize record_size, 
+    guint n_records, CtransRecordFunc fn, gpointer user_data, guint* n_failed) 
+{
+    CtransRecordResult* results;
+    guint idx, failed = 0;
+    results = ctrans_try_malloc(pTrans, MAX(n_records, 1)*sizeof(CtransRecordResult), TRUE);
+    if (results == NULL) 
+      {
+        // a handler resumed the exception
+        if (n_failed != NULL) *n_failed = 0;
+        return NULL;
+      }
+    for (idx = 0; idx < n_records; idx++) 
+      {
+        if (!ctrans_process_one(pTrans, (guint8*)records + idx*record_size, fn, 
+                user_data, &results[idx])) 
+          {
+            failed++;
+          }
+      }
+    if (n_failed != NULL) *n_failed = failed;
+    return results;
+}
+
+guint
+ctrans_process_iter (Transaction* pTrans, CtransRecordIter next, gpointer iter_data,
+    CtransRecordFunc fn, gpointer user_data, CtransRecordResult** results, guint* n_failed) 
+{
+    CtransRecordResult* vector;
+    guint capacity = 64, count = 0, failed = 0;
+    gpointer record;
+    vector = ctrans_try_malloc(pTrans, capacity*sizeof(CtransRecordResult), TRUE);
+    // A failed allocation that a handler resumed stops before taking
+    // the next record, so none is lost
+    while (vector != NULL) 
+      {
+        if (count == capacity) 
+          {
+            CtransRecordResult* bigger = ctrans_try_realloc(pTrans, vector, 
+                2*capacity*sizeof(CtransRecordResult), TRUE);
+            if (bigger == NULL) break;
+            vector    = bigger;
+            capacity *= 2;
+          }
+        if ((record = next(iter_data)) == NULL) break;
+        if (!ctrans_process_one(pTrans, record, fn, user_data, &vector[count])) 
+          {
+            failed++;
+          }
+        count++;
       }
+    if (n_failed != NULL) *n_failed = failed;
+    *results = vector;
+    return count;
 }
 
-void
-ctrans_restore_Stack(Transaction* pTrans)
-{ 
-    // TODO(1): Implementation depends on CPU architecture. 
-    //          Next code work just for x86 (stack growing down in memory).
-    guint32 stackBotton;
-    int idx=0;
-    for (idx = 0; idx<pTrans->stack_size; ++idx) 
+/*
+ * Entry point of the side stack. Running here, the snapshot can be
+ * copied back over the thread stack without overwriting our own frame.
+ */
+static void
+ctrans_side_stack_jump (void) 
+{
+    CtransThreadState* state = ctrans_get_thread_state();
+    ctrans_restore_Stack(state->jump_trans);
+    longjmp(state->jump_trans->transStart, state->jump_state);
+}
+
+/*
+ * Jumps back to the setjmp done by NEWTRANSACTION. Without a stack
+ * snapshot the frame is still alive and this is a plain longjmp.
+ * Otherwise we switch to a per-thread side stack (prepared once) and
+ * restore the snapshot from there, so the cost does not depend on
+ * where the current frame lies respect to the saved region. The
+ * longjmp off the side stack can't be a setcontext (the target is the
+ * jmp_buf of the macro): see CTRANS_SIDE_STACK_SIZE for _FORTIFY_SOURCE.
+ */
+static void
+ctrans_jump_to_start(Transaction* pTrans, gint tranState) 
+{
+    CTRANS_PROBE3(jump, pTrans->id, pTrans->sDebug, tranState);
+    if (pTrans->flags & CTRANS_STACK_SNAPSHOT) 
       {
-        pTrans->stack_ptr2Top[-idx] = pTrans->stack_backup[idx]; 
+        CtransThreadState* state = ctrans_get_thread_state();
+        if (state->side_stack == NULL) 
+          {
+            state->side_stack = g_malloc(CTRANS_SIDE_STACK_SIZE);
+            getcontext(&state->side_context);
+            state->side_context.uc_stack.ss_sp   = state->side_stack;
+            state->side_context.uc_stack.ss_size = CTRANS_SIDE_STACK_SIZE;
+            state->side_context.uc_link          = NULL;
+            makecontext(&state->side_context, ctrans_side_stack_jump, 0);
+          }
+        state->jump_trans = pTrans;
+        state->jump_state = tranState;
+        setcontext(&state->side_context);
       }
+    longjmp(pTrans->transStart,tranState);
 }
 
-
-gint
-ctrans_new_transaction (guint32* stack_ptr2Top, Transaction** ppTrans, 
-    Transaction* pParentTrans, gchar* sDebug) 
+/*
+ * Ends a long-lived transaction that is not resumed: there is no frame
+ * to jump to, so FUN_STOP/FUN_EXC run right here and we return.
+ */
+static void
+ctrans_end_suspended (Transaction* pTrans, gint tranState) 
 {
-    guint32 ptr2stackBotton;
-    *ppTrans = g_malloc(sizeof(Transaction));
-    if (*ppTrans == NULL) 
+    if (tranState == TRANS_STOP && pTrans->n_prepare != 0) 
       {
-        g_print("CRITICAL: Unable to allocate memory. Exiting now");
-        exit(1);
+        // A hook refusing the commit raises: resumed, the transaction is
+        // rolled back once and the raise jumps back here
+        ctrans_resume_transaction(pTrans);
+        if (setjmp(pTrans->transStart) == EXCEPTION_CAPTURED) 
+          {
+            if (pTrans->fun_exc != 0) pTrans->fun_exc(pTrans);
+            ctrans_release_transaction(pTrans);
+            return;
+          }
+        ctrans_run_prepare(pTrans);
+        ctrans_suspend_transaction(pTrans);
       }
-    ctrans_backup_Stack(stack_ptr2Top, *ppTrans, &ptr2stackBotton);
-    (*ppTrans)->allocated_memory   = 0 ;
-    (*ppTrans)->child_transactions = 0 ;
-    if (pParentTrans != 0) 
+    ctrans_stats_end(pTrans, tranState == TRANS_STOP);
+    if (tranState == TRANS_STOP) 
       {
-        (*pParentTrans).child_transactions = g_list_prepend(
-            (*pParentTrans).child_transactions,*ppTrans);
+        ctrans_undo_commit(pTrans);
       }
-    if (sDebug == NULL) 
+    ctrans_free_resources(pTrans);
+    if (tranState == TRANS_STOP) 
       {
-        (*ppTrans)->sDebug = g_strdup("");
+        if (pTrans->fun_stop != 0) pTrans->fun_stop(pTrans);
       }
     else
       {
-        (*ppTrans)->sDebug = g_strdup(sDebug);
+        if (pTrans->fun_exc != 0) pTrans->fun_exc(pTrans);
       }
-    int result = setjmp((*ppTrans)->transStart);
+    ctrans_release_transaction(pTrans);
+}
 
-    if (result==TRANS_STOP || result==EXCEPTION_CAPTURED) 
+void 
+ctrans_finish_transaction(Transaction* pTrans) 
+{
+    CTRANS_PROBE2(finish, pTrans->id, pTrans->sDebug);
+    if ((pTrans->flags & CTRANS_LONG_LIVED) && !pTrans->resumed) 
       {
-        ctrans_free_resources(*ppTrans);
+        ctrans_end_suspended(pTrans, TRANS_STOP);
+        return;
       }
-    return result;
+    if (pTrans->n_prepare != 0) 
+      {
+        ctrans_run_prepare(pTrans);
+      }
+    ctrans_stats_end(pTrans, TRUE);
+    ctrans_unwind_current(ctrans_get_thread_state(), pTrans);
+    ctrans_undo_commit(pTrans);
+    ctrans_free_resources(pTrans);
+    ctrans_jump_to_start(pTrans, TRANS_STOP);
 }
 
-gpointer
-ctrans_try_malloc (Transaction* pTrans, gsize n_bytes, gboolean bRaiseException) 
+void
+ctrans_restart_transaction (Transaction* pTrans) 
 {
-    gpointer result = g_try_malloc(n_bytes);
-    if (!result) 
+    if (pTrans->flags & CTRANS_LONG_LIVED) 
       {
-        if (bRaiseException==FALSE) return NULL;
-        // If NULL is not allowed raise an administratorException
-        // TODO(0): This is not "very legal" for a library, but enough for a first draft.
-        // It could be caused by a programming mistake with an n_bytes non-sense value.
-        // Change for a senderException.
-        ctrans_raise_sender_exception(pTrans, 1/*TODO(0): guint32 type*/, "g_try_malloc failed @ ctrans_try_malloc", "") ;
+        // No frame to restart from: refuse instead of going on
+        ctrans_raise_recipient_exception(pTrans, IMPLEMENTATION, "restart of a long-lived transaction",
+            pTrans->sDebug, "raise an exception to refuse the commit");
+        return;
       }
-    pTrans->allocated_memory = g_list_append(
-        pTrans->allocated_memory, result);
-    return result;
+    CTRANS_STATS_ADD(pTrans, restarts, 1);
+    ctrans_unwind_current(ctrans_get_thread_state(), pTrans);
+    pTrans->raisedException = 0; // the cleanups don't see a failure
+    ctrans_free_resources(pTrans);
+    ctrans_jump_to_start(pTrans, TRANS_RESTART);
 }
 
 void
-ctrans_free_resources (Transaction* pTrans) 
+ctrans_set_budget (Transaction* pTrans, gsize max_bytes) 
+{
+    pTrans->byte_budget = max_bytes;
+}
+
+void
+ctrans_set_name_budget (const gchar* sDebug, gsize max_bytes) 
 {
-    if ((*pTrans).child_transactions != 0 ) 
+    g_rw_lock_writer_lock(&ctrans_budget_lock);
+    if (ctrans_name_budgets == NULL) 
       {
-        //TODO(0): ctrans_free_resources over child_transactions
+        ctrans_name_budgets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
       }
-    if ((*pTrans).allocated_memory != 0 ) 
+    if (max_bytes == 0) 
       {
-        guint listSize = g_list_length((*pTrans).allocated_memory);
-        guint idx=0;
-        for (idx=0; idx<listSize; idx++) 
-          {
-            gpointer p = g_list_nth_data((*pTrans).allocated_memory,idx);
-            g_free(p);
-          }
-        g_list_free((*pTrans).allocated_memory);
-
+        g_hash_table_remove(ctrans_name_budgets, sDebug);
       }
+    else
+      {
+        g_hash_table_replace(ctrans_name_budgets, g_strdup(sDebug), GSIZE_TO_POINTER(max_bytes));
+      }
+    g_atomic_int_set(&ctrans_n_name_budgets, g_hash_table_size(ctrans_name_budgets));
+    g_rw_lock_writer_unlock(&ctrans_budget_lock);
 }
 
-void 
-ctrans_finish_transaction(Transaction* pTrans) 
+void
+ctrans_set_global_budget (gsize max_bytes) 
 {
-    // TODO(0): Implementation depends on CPU architecture. 
-    //          Next code work just for x86 (stack growing down in memory).
-    if (  (pTrans->stack_ptr2Top - pTrans->stack_size) <= (guint32*) & pTrans ) 
+    ctrans_global_budget = max_bytes;
+}
+
+CtransHandlerTable*
+ctrans_handler_table_new (void) 
+{
+    return g_malloc0(sizeof(CtransHandlerTable));
+}
+
+void
+ctrans_handler_table_free (CtransHandlerTable* table) 
+{
+    g_free(table);
+}
+
+void
+ctrans_handler_table_set (CtransHandlerTable* table, guint32 class_mask, 
+    CtransExceptionHandler handler, gpointer user_data) 
+{
+    guint classes = CTRANS_EXCEPTION_CLASSES(class_mask);
+    guint idx;
+    if (classes == 0) 
+      {
+        table->slots[CTRANS_EXCEPTION_CLASS_BITS].handler   = handler;
+        table->slots[CTRANS_EXCEPTION_CLASS_BITS].user_data = user_data;
+        return;
+      }
+    for (idx = 0; idx < CTRANS_EXCEPTION_CLASS_BITS; idx++) 
       {
-        guint32 foolArray[100];
-        ctrans_finish_transaction(pTrans)  ;
-        return  ; // <-- It will never reach this code actually
+        if (classes & (1 << idx)) 
+          {
+            table->slots[idx].handler   = handler;
+            table->slots[idx].user_data = user_data;
+          }
       }
-    ctrans_restore_Stack(pTrans);
-    longjmp(pTrans->transStart,TRANS_STOP);
+}
+
+void
+ctrans_set_handler_table (Transaction* pTrans, CtransHandlerTable* table) 
+{
+    pTrans->handlers = table;
+}
+
+/*
+ * Dispatches exception to the handler of its lowest class bit.
+ * Returns TRUE if the handler resumed the exception.
+ */
+static gboolean
+ctrans_dispatch_exception (Transaction* pTrans, exception_base* exception) 
+{
+    guint classes = CTRANS_EXCEPTION_CLASSES(exception->type);
+    CtransHandlerSlot* slot = &pTrans->handlers->slots[(classes == 0) ? 
+        CTRANS_EXCEPTION_CLASS_BITS : g_bit_nth_lsf(classes, -1)];
+    if (slot->handler == NULL) return FALSE;
+    return slot->handler(pTrans, exception, slot->user_data) == CTRANS_HANDLER_RESUME;
 }
 
 void 
 ctrans_raise_exception(Transaction* pTrans, exception_base* exception) 
 {
-    // TODO(0): Implementation depends on CPU architecture. 
-    //          Next code work just for x86 (stack growing down in memory).
-    if (  (pTrans->stack_ptr2Top - pTrans->stack_size) <= (guint32*) & pTrans ) 
-      {
-        guint32 foolArray[100];
-        ctrans_raise_exception(pTrans, exception) ;
-        return  ; // <-- It will never reach this code actually
-      }
     // TODO(1): Log exception history?
-    ctrans_restore_Stack(pTrans);
+    CTRANS_PROBE3(raise, pTrans->id, pTrans->sDebug, exception->type);
     pTrans->raisedException = (exception_base*)exception;
-    longjmp(pTrans->transStart,EXCEPTION_CAPTURED);
+    if (pTrans->handlers != 0 && ctrans_dispatch_exception(pTrans, exception)) 
+      {
+        pTrans->raisedException = 0;
+        return;
+      }
+    if ((pTrans->flags & CTRANS_LONG_LIVED) && !pTrans->resumed) 
+      {
+        ctrans_end_suspended(pTrans, EXCEPTION_CAPTURED);
+        return;
+      }
+    if (pTrans->savepoint != 0) 
+      {
+        CtransSavepoint* pSavepoint = pTrans->savepoint;
+        ctrans_unwind_current(ctrans_get_thread_state(), pSavepoint->current);
+        ctrans_release_since(pTrans, pSavepoint);
+        pTrans->savepoint = pSavepoint->prev;
+        CTRANS_STATS_ADD(pTrans, savepoint_rollbacks, 1);
+        CTRANS_PROBE3(savepoint_rollback, pTrans->id, pTrans->sDebug, exception->type);
+        longjmp(pSavepoint->jmpTarget, EXCEPTION_CAPTURED);
+      }
+    ctrans_stats_end(pTrans, FALSE);
+    ctrans_unwind_current(ctrans_get_thread_state(), pTrans);
+    ctrans_free_resources(pTrans);
+    ctrans_jump_to_start(pTrans, EXCEPTION_CAPTURED);
 }
 
-void 
-ctrans_raise_sender_exception(Transaction* pTrans,
-    guint32 type, char* description_i18n, char* detail_i18n) 
+/*
+ * Fills the exception embedded in the transaction. Raising never
+ * allocates: the object lives as long as the transaction (until
+ * exception_captured returns) or until the next raise on it.
+ */
+static exception_base*
+ctrans_fill_exception (Transaction* pTrans, guint32 type, 
+    char* description_i18n, char* detail_i18n, char* solution_i18n) 
 {
-    // TODO(0): Free g_malloc
-    recipient_exception* re = (recipient_exception *) 
-            g_malloc(sizeof(recipient_exception));
+    recipient_exception* re = &pTrans->exception;
     ((exception_base*)re)->type = type;
     ((exception_base*)re)->serial_number        = 0; //TODO(1)
     ((exception_base*)re)->parent_serial_number = 0; //TODO(1)
     ((exception_base*)re)->ms_timestamp         = 0; //TODO(1)
     ((exception_base*)re)->description_i18n     = description_i18n;
-    ((exception_base*)re)->detail_i18n          = description_i18n;
-    ((exception_base*)re)->gthread              = (GThread*)0; //TODO(1)
-    ctrans_raise_exception(pTrans, (exception_base*) re) ;
+    ((exception_base*)re)->detail_i18n          = detail_i18n;
+    ((exception_base*)re)->gthread              = g_thread_self();
+    ((exception_base*)re)->message              = 0;
+    re->solution_i18n                           = solution_i18n;
+    return (exception_base*) re;
+}
+
+void 
+ctrans_raise_sender_exception(Transaction* pTrans,
+    guint32 type, char* description_i18n, char* detail_i18n) 
+{
+    ctrans_raise_exception(pTrans, ctrans_fill_exception(pTrans, type, 
+        description_i18n, detail_i18n, NULL)) ;
 };
 
 /**
@@ -202,16 +1969,493 @@ void
 ctrans_raise_recipient_exception(Transaction* pTrans,
     recipEx_type type, char* description_i18n, char* detail_i18n, char* solution_i18n) 
 {
-    // TODO(0): Free g_malloc
-    recipient_exception* re = (recipient_exception *) 
-            malloc(sizeof(recipient_exception));
-    ((exception_base*)re)->type = type;
-    ((exception_base*)re)->serial_number        = 0; //TODO(1)
-    ((exception_base*)re)->parent_serial_number = 0; //TODO(1)
-    ((exception_base*)re)->ms_timestamp         = 0; //TODO(1)
-    ((exception_base*)re)->description_i18n     = description_i18n;
-    ((exception_base*)re)->detail_i18n          = description_i18n;
-    ((exception_base*)re)->gthread              = (GThread*)0; //TODO(1)
-    re->solution_i18n                           = solution_i18n;
-    ctrans_raise_exception(pTrans, (exception_base*) re) ;
+    ctrans_raise_exception(pTrans, ctrans_fill_exception(pTrans, type, 
+        description_i18n, detail_i18n, solution_i18n)) ;
 };
+
+void 
+ctrans_raise_copy(Transaction* pTrans, const exception_base* exception) 
+{
+    const gchar* texts[3];
+    gchar* copies[3];
+    gchar* buffer;
+    CtransMessageId message = exception->message;
+    CtransMessageArg args[CTRANS_MESSAGE_ARGS];
+    exception_base* copy;
+    memcpy(args, exception->args, sizeof(args));
+    texts[0] = exception->description_i18n;
+    texts[1] = exception->detail_i18n;
+    texts[2] = ((const recipient_exception*)exception)->solution_i18n;
+    // The texts may come from the old buffer: free it after copying
+    buffer = ctrans_copy_texts(texts, copies);
+    g_free(pTrans->exception_text);
+    pTrans->exception_text = buffer;
+    copy = ctrans_fill_exception(pTrans, exception->type, copies[0], copies[1], copies[2]);
+    copy->message = message;
+    memcpy(copy->args, args, sizeof(args));
+    ctrans_raise_exception(pTrans, copy) ;
+}
+
+/*
+ * Message catalog. Entries are never removed: an id is an index in
+ * ctrans_messages, published by ctrans_n_messages once filled, so
+ * raising reads it without locking.
+ */
+typedef enum {
+    CTRANS_ARG_NONE = 0, CTRANS_ARG_INT, CTRANS_ARG_UINT, CTRANS_ARG_LONG, CTRANS_ARG_ULONG,
+    CTRANS_ARG_LLONG, CTRANS_ARG_ULLONG, CTRANS_ARG_SSIZE, CTRANS_ARG_SIZE,
+    CTRANS_ARG_DOUBLE, CTRANS_ARG_STRING, CTRANS_ARG_POINTER
+} CtransArgKind;
+
+#define CTRANS_MESSAGE_SPEC_MAX 32 // longest conversion, as "%-+#012.8lld"
+
+typedef struct {
+    const gchar* name;
+    guint32      type;
+    const gchar* formats[3];   // description, detail, solution
+    guint        n_args;
+    guint8       kinds[CTRANS_MESSAGE_ARGS];
+} CtransMessage;
+
+static GMutex         ctrans_messages_lock;    // protects the registration
+static GHashTable*    ctrans_messages_by_name; // name -> id
+static CtransMessage* ctrans_messages[CTRANS_MESSAGES_MAX];
+static gint           ctrans_n_messages = 1;   // 0 is no message
+
+/*
+ * Reads the conversion at fmt (fmt[0] is '%'). Returns its length, or
+ * 0 if it's not supported. position is the N of %N$ minus one, -1 if
+ * there is none, and spec points after the '%' or the N$. kind is
+ * CTRANS_ARG_NONE for "%%".
+ */
+static guint
+ctrans_message_spec (const gchar* fmt, gint* position, CtransArgKind* kind, const gchar** spec) 
+{
+    const gchar* p = fmt + 1;
+    const gchar* length;
+    gboolean is_long, is_llong, is_size;
+    guint n = 0;
+    *position = -1;
+    *kind     = CTRANS_ARG_NONE;
+    if (*p == '%') return 2;
+    while (g_ascii_isdigit(*p)) n = 10 * n + (*p++ - '0');
+    if (*p == '$' && n > 0) 
+      {
+        *position = n - 1;
+        p++;
+      }
+    else 
+      {
+        p = fmt + 1;
+      }
+    *spec = p;
+    while (*p != 0 && strchr("-+ #0'", *p) != NULL) p++;
+    while (g_ascii_isdigit(*p)) p++;
+    if (*p == '.') 
+      {
+        p++;
+        while (g_ascii_isdigit(*p)) p++;
+      }
+    length = p;
+    if (strncmp(p, "hh", 2) == 0 || strncmp(p, "ll", 2) == 0) p += 2;
+    else if (*p == 'h' || *p == 'l' || *p == 'z') p++;
+    is_long  = (p - length == 1 && *length == 'l');
+    is_llong = (p - length == 2 && *length == 'l');
+    is_size  = (*length == 'z');
+    switch (*p) 
+      {
+        case 'd': case 'i':
+          *kind = is_llong ? CTRANS_ARG_LLONG : is_long ? CTRANS_ARG_LONG : 
+                  is_size ? CTRANS_ARG_SSIZE : CTRANS_ARG_INT;
+          break;
+        case 'u': case 'o': case 'x': case 'X':
+          *kind = is_llong ? CTRANS_ARG_ULLONG : is_long ? CTRANS_ARG_ULONG : 
+                  is_size ? CTRANS_ARG_SIZE : CTRANS_ARG_UINT;
+          break;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+          if (p != length && !is_long) return 0;
+          *kind = CTRANS_ARG_DOUBLE;
+          break;
+        case 'c': case 's': case 'p':
+          if (p != length) return 0;
+          *kind = (*p == 'c') ? CTRANS_ARG_INT : (*p == 's') ? CTRANS_ARG_STRING : CTRANS_ARG_POINTER;
+          break;
+        default:
+          return 0;
+      }
+    if (p + 1 - fmt >= CTRANS_MESSAGE_SPEC_MAX) return 0;
+    return p + 1 - fmt;
+}
+
+/*
+ * Records in message the kind of each argument used by fmt.
+ */
+static gboolean
+ctrans_message_parse (CtransMessage* message, const gchar* fmt) 
+{
+    CtransArgKind kind;
+    const gchar* spec;
+    gint position, next = 0;
+    guint len;
+    if (fmt == NULL) return TRUE;
+    for (fmt = strchr(fmt, '%'); fmt != NULL; fmt = strchr(fmt + len, '%')) 
+      {
+        len = ctrans_message_spec(fmt, &position, &kind, &spec);
+        if (len == 0) return FALSE;
+        if (kind == CTRANS_ARG_NONE) continue;
+        if (position < 0) position = next++;
+        if (position >= CTRANS_MESSAGE_ARGS) return FALSE;
+        if (message->kinds[position] != CTRANS_ARG_NONE && message->kinds[position] != kind) return FALSE;
+        message->kinds[position] = kind;
+        message->n_args = MAX(message->n_args, (guint)position + 1);
+      }
+    return TRUE;
+}
+
+CtransMessageId
+ctrans_message_register (const gchar* name, guint32 type, 
+    const gchar* description_fmt, const gchar* detail_fmt, const gchar* solution_fmt) 
+{
+    CtransMessage* message;
+    CtransMessageId id;
+    guint idx;
+    g_return_val_if_fail(name != NULL && description_fmt != NULL, 0);
+    g_mutex_lock(&ctrans_messages_lock);
+    if (ctrans_messages_by_name == NULL) 
+      {
+        ctrans_messages_by_name = g_hash_table_new(g_str_hash, g_str_equal);
+      }
+    id = GPOINTER_TO_UINT(g_hash_table_lookup(ctrans_messages_by_name, name));
+    if (id != 0 || ctrans_n_messages == CTRANS_MESSAGES_MAX) 
+      {
+        g_mutex_unlock(&ctrans_messages_lock);
+        return id;
+      }
+    message = g_malloc0(sizeof(CtransMessage));
+    if (!ctrans_message_parse(message, description_fmt) || 
+        !ctrans_message_parse(message, detail_fmt) || 
+        !ctrans_message_parse(message, solution_fmt)) 
+      {
+        g_mutex_unlock(&ctrans_messages_lock);
+        g_free(message);
+        g_warning("libctrans: message %s: unsupported format", name);
+        return 0;
+      }
+    for (idx = 0; idx < message->n_args; idx++) 
+      {
+        if (message->kinds[idx] == CTRANS_ARG_NONE) 
+          {
+            // the type of an unused argument is unknown: it can't be skipped
+            g_mutex_unlock(&ctrans_messages_lock);
+            g_free(message);
+            g_warning("libctrans: message %s: argument %u not used", name, idx + 1);
+            return 0;
+          }
+      }
+    message->name       = g_intern_string(name);
+    message->type       = type;
+    message->formats[0] = g_intern_string(description_fmt);
+    message->formats[1] = g_intern_string(detail_fmt);
+    message->formats[2] = g_intern_string(solution_fmt);
+    id = ctrans_n_messages;
+    ctrans_messages[id] = message;
+    g_hash_table_insert(ctrans_messages_by_name, (gpointer)message->name, GUINT_TO_POINTER(id));
+    g_atomic_int_set(&ctrans_n_messages, id + 1);
+    g_mutex_unlock(&ctrans_messages_lock);
+    return id;
+}
+
+CtransMessageId
+ctrans_message_lookup (const gchar* name) 
+{
+    CtransMessageId id = 0;
+    g_mutex_lock(&ctrans_messages_lock);
+    if (ctrans_messages_by_name != NULL) 
+      {
+        id = GPOINTER_TO_UINT(g_hash_table_lookup(ctrans_messages_by_name, name));
+      }
+    g_mutex_unlock(&ctrans_messages_lock);
+    return id;
+}
+
+static const CtransMessage*
+ctrans_message_get (CtransMessageId id) 
+{
+    if (id == 0 || id >= (guint)g_atomic_int_get(&ctrans_n_messages)) return NULL;
+    return ctrans_messages[id];
+}
+
+static void
+ctrans_raise_message_valist (Transaction* pTrans, CtransMessageId id, va_list args) 
+{
+    const CtransMessage* message = ctrans_message_get(id);
+    exception_base* exception;
+    guint idx;
+    if (message == NULL) 
+      {
+        // 0 is what a failed ctrans_message_register returns
+        g_free(pTrans->exception_text);
+        pTrans->exception_text = g_strdup_printf("message id %u", id);
+        ctrans_raise_recipient_exception(pTrans, IMPLEMENTATION, "unknown message", 
+            pTrans->exception_text, "check the ctrans_message_register of this message");
+        return;
+      }
+    exception = ctrans_fill_exception(pTrans, message->type, NULL, NULL, NULL);
+    exception->message = id;
+    for (idx = 0; idx < message->n_args; idx++) 
+      {
+        CtransMessageArg* arg = &exception->args[idx];
+        switch (message->kinds[idx]) 
+          {
+            case CTRANS_ARG_INT:     arg->i = va_arg(args, int);                break;
+            case CTRANS_ARG_UINT:    arg->u = va_arg(args, unsigned int);       break;
+            case CTRANS_ARG_LONG:    arg->i = va_arg(args, long);               break;
+            case CTRANS_ARG_ULONG:   arg->u = va_arg(args, unsigned long);      break;
+            case CTRANS_ARG_LLONG:   arg->i = va_arg(args, long long);          break;
+            case CTRANS_ARG_ULLONG:  arg->u = va_arg(args, unsigned long long); break;
+            case CTRANS_ARG_SSIZE:   arg->i = va_arg(args, gssize);             break;
+            case CTRANS_ARG_SIZE:    arg->u = va_arg(args, gsize);              break;
+            case CTRANS_ARG_DOUBLE:  arg->d = va_arg(args, double);             break;
+            case CTRANS_ARG_STRING:
+            case CTRANS_ARG_POINTER: arg->p = va_arg(args, gconstpointer);      break;
+          }
+      }
+    ctrans_raise_exception(pTrans, exception);
+}
+
+void 
+ctrans_raise_message(Transaction* pTrans, CtransMessageId message, ...) 
+{
+    va_list args;
+    va_start(args, message);
+    ctrans_raise_message_valist(pTrans, message, args);
+    va_end(args);
+}
+
+/*
+ * Appends fmt to text, taking the arguments from args.
+ */
+static void
+ctrans_message_format (GString* text, const gchar* fmt, const CtransMessageArg* args) 
+{
+    gchar spec[CTRANS_MESSAGE_SPEC_MAX];
+    CtransArgKind kind;
+    const gchar* percent;
+    const gchar* conversion;
+    gint position, next = 0;
+    guint len;
+    while ((percent = strchr(fmt, '%')) != NULL) 
+      {
+        g_string_append_len(text, fmt, percent - fmt);
+        len = ctrans_message_spec(percent, &position, &kind, &conversion);
+        fmt = percent + len;
+        if (kind == CTRANS_ARG_NONE) 
+          {
+            g_string_append_c(text, '%');
+            continue;
+          }
+        if (position < 0) position = next++;
+        // printf gets the conversion without its N$
+        spec[0] = '%';
+        memcpy(spec + 1, conversion, fmt - conversion);
+        spec[1 + (fmt - conversion)] = 0;
+        switch (kind) 
+          {
+            case CTRANS_ARG_INT:     g_string_append_printf(text, spec, (int)args[position].i);                break;
+            case CTRANS_ARG_UINT:    g_string_append_printf(text, spec, (unsigned int)args[position].u);       break;
+            case CTRANS_ARG_LONG:    g_string_append_printf(text, spec, (long)args[position].i);               break;
+            case CTRANS_ARG_ULONG:   g_string_append_printf(text, spec, (unsigned long)args[position].u);      break;
+            case CTRANS_ARG_LLONG:   g_string_append_printf(text, spec, (long long)args[position].i);          break;
+            case CTRANS_ARG_ULLONG:  g_string_append_printf(text, spec, (unsigned long long)args[position].u); break;
+            case CTRANS_ARG_SSIZE:   g_string_append_printf(text, spec, (gssize)args[position].i);             break;
+            case CTRANS_ARG_SIZE:    g_string_append_printf(text, spec, (gsize)args[position].u);              break;
+            case CTRANS_ARG_DOUBLE:  g_string_append_printf(text, spec, args[position].d);                     break;
+            case CTRANS_ARG_STRING:
+            case CTRANS_ARG_POINTER: g_string_append_printf(text, spec, args[position].p);                     break;
+            default: break;
+          }
+      }
+    g_string_append(text, fmt);
+}
+
+void 
+ctrans_format_exception(Transaction* pTrans, exception_base* exception) 
+{
+    const CtransMessage* message = ctrans_message_get(exception->message);
+    gsize offsets[3];
+    GString* text;
+    guint idx;
+    if (message == NULL || exception->description_i18n != NULL) return;
+    text = g_string_sized_new(128);
+    for (idx = 0; idx < 3; idx++) 
+      {
+        offsets[idx] = text->len;
+        if (message->formats[idx] == NULL) continue;
+        ctrans_message_format(text, message->formats[idx], exception->args);
+        g_string_append_c(text, 0);
+      }
+    g_free(pTrans->exception_text);
+    pTrans->exception_text = g_string_free(text, FALSE);
+    exception->description_i18n = pTrans->exception_text + offsets[0];
+    exception->detail_i18n      = (message->formats[1] != NULL) ? pTrans->exception_text + offsets[1] : NULL;
+    ((recipient_exception*)exception)->solution_i18n = 
+        (message->formats[2] != NULL) ? pTrans->exception_text + offsets[2] : NULL;
+}
+
+Transaction*
+ctrans_current (void) 
+{
+    return ctrans_get_thread_state()->current;
+}
+
+/*
+ * Innermost transaction of the thread. Using the implicit variants
+ * outside of any transaction is a programming error.
+ */
+static Transaction*
+ctrans_current_or_die (void) 
+{
+    Transaction* pTrans = ctrans_get_thread_state()->current;
+    if (pTrans == NULL) 
+      {
+        g_error("libctrans: no active transaction in this thread");
+      }
+    return pTrans;
+}
+
+gpointer
+ctrans_current_try_malloc (gsize n_bytes, gboolean bRaiseException) 
+{
+    return ctrans_try_malloc(ctrans_current_or_die(), n_bytes, bRaiseException);
+}
+
+void 
+ctrans_current_raise_sender_exception(guint32 type, char* description_i18n, char* detail_i18n) 
+{
+    ctrans_raise_sender_exception(ctrans_current_or_die(), type, 
+        description_i18n, detail_i18n);
+}
+
+void 
+ctrans_current_raise_recipient_exception(recipEx_type type, 
+    char* description_i18n, char* detail_i18n, char* solution_i18n) 
+{
+    ctrans_raise_recipient_exception(ctrans_current_or_die(), type, 
+        description_i18n, detail_i18n, solution_i18n);
+}
+
+void 
+ctrans_current_raise_message(CtransMessageId message, ...) 
+{
+    Transaction* pTrans = ctrans_current_or_die();
+    va_list args;
+    va_start(args, message);
+    ctrans_raise_message_valist(pTrans, message, args);
+    va_end(args);
+}
+
+#ifndef CTRANS_NO_STATS
+/*
+ * from may be a counter set of another thread, updated meanwhile: each
+ * counter is read atomically, the set as a whole is only exact once
+ * the threads are quiet.
+ */
+static void
+ctrans_stats_merge (CtransStats* into, const CtransStats* from) 
+{
+    guint64*       dst = (guint64*)into;
+    const guint64* src = (const guint64*)from;
+    guint idx;
+    for (idx = 0; idx < sizeof(CtransStats)/sizeof(guint64); idx++) 
+      {
+        dst[idx] += __atomic_load_n(&src[idx], __ATOMIC_RELAXED);
+      }
+}
+
+static void
+ctrans_stats_merge_name (gpointer name, gpointer stats, gpointer merged) 
+{
+    CtransStats* into = g_hash_table_lookup(merged, name);
+    if (into == NULL) 
+      {
+        into = g_malloc0(sizeof(CtransStats));
+        g_hash_table_insert(merged, name, into);
+      }
+    ctrans_stats_merge(into, stats);
+}
+
+typedef struct {
+    CtransStatsFunc fn;
+    gpointer        user_data;
+} CtransStatsForeach;
+
+static void
+ctrans_stats_call (gpointer name, gpointer stats, gpointer data) 
+{
+    CtransStatsForeach* foreach = data;
+    foreach->fn(name, stats, foreach->user_data);
+}
+#endif
+
+void
+ctrans_stats_get (CtransStats* stats) 
+{
+    memset(stats, 0, sizeof(CtransStats));
+#ifndef CTRANS_NO_STATS
+    GSList* link;
+    g_mutex_lock(&ctrans_stats_lock);
+    for (link = ctrans_stats_shards; link != NULL; link = link->next) 
+      {
+        ctrans_stats_merge(stats, &((CtransStatsShard*)link->data)->total);
+      }
+    g_mutex_unlock(&ctrans_stats_lock);
+#endif
+}
+
+gboolean
+ctrans_stats_get_by_name (const gchar* sDebug, CtransStats* stats) 
+{
+    gboolean found = FALSE;
+    memset(stats, 0, sizeof(CtransStats));
+#ifndef CTRANS_NO_STATS
+    GSList* link;
+    g_mutex_lock(&ctrans_stats_lock);
+    for (link = ctrans_stats_shards; link != NULL; link = link->next) 
+      {
+        CtransStatsShard* shard = link->data;
+        CtransStats* shard_stats;
+        g_mutex_lock(&shard->lock);
+        shard_stats = g_hash_table_lookup(shard->by_name, sDebug);
+        if (shard_stats != NULL) 
+          {
+            ctrans_stats_merge(stats, shard_stats);
+            found = TRUE;
+          }
+        g_mutex_unlock(&shard->lock);
+      }
+    g_mutex_unlock(&ctrans_stats_lock);
+#endif
+    return found;
+}
+
+void
+ctrans_stats_foreach (CtransStatsFunc fn, gpointer user_data) 
+{
+#ifndef CTRANS_NO_STATS
+    // Names are owned by the shards, which are never freed
+    GHashTable* merged = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+    CtransStatsForeach foreach = { fn, user_data };
+    GSList* link;
+    g_mutex_lock(&ctrans_stats_lock);
+    for (link = ctrans_stats_shards; link != NULL; link = link->next) 
+      {
+        CtransStatsShard* shard = link->data;
+        g_mutex_lock(&shard->lock);
+        g_hash_table_foreach(shard->by_name, ctrans_stats_merge_name, merged);
+        g_mutex_unlock(&shard->lock);
+      }
+    g_mutex_unlock(&ctrans_stats_lock);
+    g_hash_table_foreach(merged, ctrans_stats_call, &foreach);
+    g_hash_table_destroy(merged);
+#endif
+}
@@ -0,0 +1,166 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "libctrans_mainloop.h"
+
+typedef struct {
+    GSource              source;
+    GAsyncQueue*         queue;
+    gchar*               sDebug;
+    guint                flags;
+    guint                max_batch;
+    CtransEventHandler   handler;
+    CtransEventErrorFunc on_error;
+    GDestroyNotify       event_free;
+    gpointer             user_data;
+} CtransEventSource;
+
+static void
+ctrans_event_batch_nop (G_GNUC_UNUSED Transaction* pTrans)
+{
+}
+
+/*
+ * Calls on_error under a savepoint of its own: if it raises too, what
+ * it acquired is released and the batch goes on.
+ */
+static void
+ctrans_event_source_failed (CtransEventSource* es, Transaction* pTrans, gpointer event)
+{
+    CtransSavepoint sp;
+    NEWSAVEPOINT(pTrans, sp)
+      {
+        es->on_error(pTrans, event, es->user_data);
+        RELEASESAVEPOINT(pTrans, sp);
+      }
+    else
+      {
+        ctrans_format_exception(pTrans, pTrans->raisedException);
+        g_warning("%s: error function raised: %s", pTrans->sDebug,
+            pTrans->raisedException->description_i18n);
+      }
+}
+
+/*
+ * Runs one event under a savepoint of the batch transaction. The jump
+ * target lives in this frame, so a failing event never disturbs the
+ * locals of the batch loop.
+ */
+static void
+ctrans_event_source_run_one (CtransEventSource* es, Transaction* pTrans, gpointer event)
+{
+    CtransSavepoint sp;
+    NEWSAVEPOINT(pTrans, sp)
+      {
+        es->handler(pTrans, event, es->user_data);
+        RELEASESAVEPOINT(pTrans, sp);
+      }
+    else if (es->on_error != NULL)
+      {
+        ctrans_event_source_failed(es, pTrans, event);
+      }
+    else
+      {
+        ctrans_format_exception(pTrans, pTrans->raisedException);
+        g_warning("%s: event failed: %s", pTrans->sDebug,
+            pTrans->raisedException->description_i18n);
+      }
+}
+
+static void
+ctrans_event_source_run_batch (CtransEventSource* es)
+{
+    guint n_events;
+    Transaction* Batch;
+    NEWTRANSACTION_FULL(Batch, ctrans_event_batch_nop, ctrans_event_batch_nop,
+        ctrans_event_batch_nop, es->sDebug, es->flags);
+    for (n_events = 0; n_events < es->max_batch; n_events++)
+      {
+        gpointer event = g_async_queue_try_pop(es->queue);
+        if (event == NULL) break;
+        // Registered out of the savepoint: the event outlives its rollback
+        if (es->event_free != NULL) ctrans_defer(Batch, es->event_free, event);
+        ctrans_event_source_run_one(es, Batch, event);
+      }
+    ENDTRANSACTION(Batch);
+}
+
+static gboolean
+ctrans_event_source_prepare (GSource* source, gint* timeout)
+{
+    *timeout = -1;
+    return g_async_queue_length(((CtransEventSource*)source)->queue) > 0;
+}
+
+static gboolean
+ctrans_event_source_check (GSource* source)
+{
+    return g_async_queue_length(((CtransEventSource*)source)->queue) > 0;
+}
+
+static gboolean
+ctrans_event_source_dispatch (GSource* source, G_GNUC_UNUSED GSourceFunc callback,
+    G_GNUC_UNUSED gpointer user_data)
+{
+    ctrans_event_source_run_batch((CtransEventSource*)source);
+    return TRUE;
+}
+
+static void
+ctrans_event_source_finalize (GSource* source)
+{
+    CtransEventSource* es = (CtransEventSource*)source;
+    g_async_queue_unref(es->queue); // frees the events never dispatched
+    g_free(es->sDebug);
+}
+
+static GSourceFuncs ctrans_event_source_funcs = {
+    .prepare  = ctrans_event_source_prepare,
+    .check    = ctrans_event_source_check,
+    .dispatch = ctrans_event_source_dispatch,
+    .finalize = ctrans_event_source_finalize,
+};
+
+GSource*
+ctrans_event_source_new (const gchar* sDebug, guint flags, guint max_batch,
+    CtransEventHandler handler, CtransEventErrorFunc on_error,
+    GDestroyNotify event_free, gpointer user_data)
+{
+    GSource* source = g_source_new(&ctrans_event_source_funcs, sizeof(CtransEventSource));
+    CtransEventSource* es = (CtransEventSource*)source;
+    es->queue      = (event_free != NULL) ? g_async_queue_new_full(event_free)
+                                          : g_async_queue_new();
+    es->sDebug     = g_strdup(sDebug);
+    es->flags      = flags;
+    es->max_batch  = (max_batch == 0) ? CTRANS_EVENT_BATCH_SIZE : max_batch;
+    es->handler    = handler;
+    es->on_error   = on_error;
+    es->event_free = event_free;
+    es->user_data  = user_data;
+    g_source_set_name(source, sDebug);
+    return source;
+}
+
+void
+ctrans_event_source_push (GSource* source, gpointer event)
+{
+    GMainContext* context;
+    g_async_queue_push(((CtransEventSource*)source)->queue, event);
+    context = g_source_get_context(source);
+    if (context != NULL) g_main_context_wakeup(context);
+}
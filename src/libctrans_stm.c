@@ -0,0 +1,320 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "libctrans_stm.h"
+
+/*
+ * A lock word is the version shifted left by one when free, or the
+ * address of the owner CtransStm with the low bit set when taken.
+ */
+#define CTRANS_STM_LOCKED(word)  ((word) & 1)
+#define CTRANS_STM_OWNER(word)   ((CtransStm*)((word) & ~(gsize)1))
+#define CTRANS_STM_VERSION(word) ((word) >> 1)
+#define CTRANS_STM_LOCK_OF(cell) ((GPOINTER_TO_SIZE(cell) >> 3) & (CTRANS_STM_LOCKS - 1))
+
+/*
+ * Consecutive conflicts of a thread after which it yields, and after
+ * which it sleeps, before running the transaction again.
+ */
+#define CTRANS_STM_YIELD_AFTER 2
+#define CTRANS_STM_SLEEP_AFTER 8
+
+typedef struct {
+    guint lock;    // index in ctrans_stm_locks
+    gsize version; // before we took it
+} CtransStmOwned;
+
+typedef struct _CtransStm CtransStm;
+
+/*
+ * STM state of an outermost transaction (Transaction.stm). Kept in a
+ * per-thread list once the transaction ends.
+ */
+struct _CtransStm {
+    Transaction*    root;
+    gsize           read_version; // snapshot: every cell read is at most this version
+    gsize           commit_version; // given by ctrans_stm_prepare, 0 before
+    guint*          reads;        // locks of the cells read
+    guint           n_reads;
+    guint           reads_capacity;
+    CtransStmOwned* owned;        // locks taken by the writes
+    guint           n_owned;
+    guint           owned_capacity;
+    CtransStm*      next_free;
+};
+
+typedef struct {
+    CtransStm* free_stm;
+    guint      conflicts; // since the last commit of the thread
+} CtransStmThread;
+
+static gsize ctrans_stm_clock;
+static gsize ctrans_stm_locks[CTRANS_STM_LOCKS];
+
+static void ctrans_stm_thread_free (gpointer data);
+static GPrivate ctrans_stm_thread = G_PRIVATE_INIT(ctrans_stm_thread_free);
+
+static void
+ctrans_stm_thread_free (gpointer data)
+{
+    CtransStmThread* thread = data;
+    while (thread->free_stm != NULL)
+      {
+        CtransStm* stm = thread->free_stm;
+        thread->free_stm = stm->next_free;
+        g_free(stm->reads);
+        g_free(stm->owned);
+        g_free(stm);
+      }
+    g_free(thread);
+}
+
+static CtransStmThread*
+ctrans_stm_get_thread (void)
+{
+    CtransStmThread* thread = g_private_get(&ctrans_stm_thread);
+    if (G_UNLIKELY(thread == NULL))
+      {
+        thread = g_malloc0(sizeof(CtransStmThread));
+        g_private_set(&ctrans_stm_thread, thread);
+      }
+    return thread;
+}
+
+/*
+ * Checks that no cell read changed since read_version.
+ */
+static gboolean
+ctrans_stm_validate (CtransStm* stm)
+{
+    guint idx, idx2;
+    for (idx = 0; idx < stm->n_reads; idx++)
+      {
+        gsize word = (gsize)g_atomic_pointer_get(&ctrans_stm_locks[stm->reads[idx]]);
+        if (!CTRANS_STM_LOCKED(word))
+          {
+            if (CTRANS_STM_VERSION(word) > stm->read_version) return FALSE;
+            continue;
+          }
+        if (CTRANS_STM_OWNER(word) != stm) return FALSE;
+        for (idx2 = 0; idx2 < stm->n_owned; idx2++)
+          {
+            if (stm->owned[idx2].lock == stm->reads[idx] &&
+                stm->owned[idx2].version > stm->read_version) return FALSE;
+          }
+      }
+    return TRUE;
+}
+
+/*
+ * Moves the snapshot to the current time if what was read is still
+ * valid, so a transaction meeting a newer cell does not always restart.
+ */
+static gboolean
+ctrans_stm_extend (CtransStm* stm)
+{
+    gsize now = (gsize)g_atomic_pointer_get(&ctrans_stm_clock);
+    if (!ctrans_stm_validate(stm)) return FALSE;
+    stm->read_version = now;
+    return TRUE;
+}
+
+/*
+ * Cleanup of the outermost transaction: releases the locks taken.
+ * After a commit they get the version of the commit. On rollback the
+ * undo log has already put the old values back and they get a new
+ * version, so a reader that saw a value written meanwhile fails its
+ * check.
+ */
+static void
+ctrans_stm_end (gpointer data)
+{
+    CtransStm* stm = data;
+    CtransStmThread* thread = ctrans_stm_get_thread();
+    guint idx;
+    if (stm->n_owned > 0)
+      {
+        gsize version = stm->commit_version;
+        if (version == 0) version = (gsize)g_atomic_pointer_add(&ctrans_stm_clock, 1) + 1;
+        for (idx = 0; idx < stm->n_owned; idx++)
+          {
+            g_atomic_pointer_set(&ctrans_stm_locks[stm->owned[idx].lock], version << 1);
+          }
+      }
+    stm->root->stm      = NULL;
+    stm->commit_version = 0;
+    stm->n_reads        = 0;
+    stm->n_owned     = 0;
+    stm->next_free   = thread->free_stm;
+    thread->free_stm = stm;
+}
+
+static void
+ctrans_stm_conflict (Transaction* pTrans, CtransStm* stm)
+{
+    Transaction* root = stm->root;
+    ctrans_stm_get_thread()->conflicts++;
+    if (root->flags & CTRANS_LONG_LIVED)
+      {
+        ctrans_raise_sender_exception(pTrans, CTRANS_STM_CONFLICT,
+            "conflict @ ctrans_stm", root->sDebug);
+        return;
+      }
+    ctrans_restart_transaction(root);
+}
+
+/*
+ * Commit: takes a new version once the reads are validated. The locks
+ * are kept until the transaction releases its resources (ctrans_stm_end),
+ * after the prepare hooks registered later (a log made durable) ran.
+ * Nothing to do for a transaction that only read.
+ */
+static void
+ctrans_stm_prepare (Transaction* pTrans, gpointer arg)
+{
+    CtransStm* stm = pTrans->stm;
+    gsize version;
+    if (stm == NULL) return; // rolled back to a savepoint older than the first access
+    if (stm->n_owned > 0)
+      {
+        version = (gsize)g_atomic_pointer_add(&ctrans_stm_clock, 1) + 1;
+        // Nobody committed since our snapshot: the reads are still valid
+        if (version != stm->read_version + 1 && !ctrans_stm_validate(stm))
+          {
+            ctrans_stm_conflict(pTrans, stm);
+          }
+        stm->commit_version = version;
+      }
+    ctrans_stm_get_thread()->conflicts = 0;
+}
+
+static void
+ctrans_stm_backoff (CtransStmThread* thread)
+{
+    if (thread->conflicts >= CTRANS_STM_SLEEP_AFTER)
+      {
+        g_usleep(MIN(1 << (thread->conflicts - CTRANS_STM_SLEEP_AFTER), 1000));
+      }
+    else if (thread->conflicts >= CTRANS_STM_YIELD_AFTER)
+      {
+        g_thread_yield();
+      }
+}
+
+/*
+ * STM state of the outermost transaction of pTrans, created at the
+ * first access.
+ */
+static CtransStm*
+ctrans_stm_begin (Transaction* pTrans)
+{
+    CtransStmThread* thread;
+    CtransStm* stm;
+    Transaction* root = pTrans;
+    guint idx;
+    while (root->parent != 0) root = root->parent;
+    if (root->stm != NULL) return root->stm;
+    thread = ctrans_stm_get_thread();
+    if (thread->conflicts > 0) ctrans_stm_backoff(thread);
+    stm = thread->free_stm;
+    if (stm != NULL)
+      {
+        thread->free_stm = stm->next_free;
+      }
+    else
+      {
+        stm = g_malloc0(sizeof(CtransStm));
+      }
+    stm->root         = root;
+    stm->read_version = (gsize)g_atomic_pointer_get(&ctrans_stm_clock);
+    root->stm         = stm;
+    ctrans_defer(root, ctrans_stm_end, stm);
+    for (idx = 0; idx < root->n_prepare; idx++)
+      {
+        if (root->prepare[idx].fn == ctrans_stm_prepare) return stm;
+      }
+    ctrans_on_prepare(root, ctrans_stm_prepare, NULL);
+    return stm;
+}
+
+gsize
+ctrans_stm_read (Transaction* pTrans, const gsize* cell)
+{
+    CtransStm* stm = ctrans_stm_begin(pTrans);
+    guint lock = CTRANS_STM_LOCK_OF(cell);
+    gsize before, after, value;
+    before = (gsize)g_atomic_pointer_get(&ctrans_stm_locks[lock]);
+    if (CTRANS_STM_LOCKED(before))
+      {
+        if (CTRANS_STM_OWNER(before) == stm) return *cell;
+        ctrans_stm_conflict(pTrans, stm);
+      }
+    value = (gsize)g_atomic_pointer_get(cell);
+    after = (gsize)g_atomic_pointer_get(&ctrans_stm_locks[lock]);
+    if (after != before ||
+        (CTRANS_STM_VERSION(before) > stm->read_version && !ctrans_stm_extend(stm)))
+      {
+        ctrans_stm_conflict(pTrans, stm);
+      }
+    if (stm->n_reads == stm->reads_capacity)
+      {
+        stm->reads_capacity = MAX(2 * stm->reads_capacity, 64);
+        stm->reads = g_realloc(stm->reads, stm->reads_capacity * sizeof(guint));
+      }
+    stm->reads[stm->n_reads++] = lock;
+    return value;
+}
+
+void
+ctrans_stm_write (Transaction* pTrans, gsize* cell, gsize value)
+{
+    CtransStm* stm = ctrans_stm_begin(pTrans);
+    guint lock = CTRANS_STM_LOCK_OF(cell);
+    gsize word = (gsize)g_atomic_pointer_get(&ctrans_stm_locks[lock]);
+    if (!CTRANS_STM_LOCKED(word) || CTRANS_STM_OWNER(word) != stm)
+      {
+        if (CTRANS_STM_LOCKED(word) ||
+            !g_atomic_pointer_compare_and_exchange(&ctrans_stm_locks[lock], word,
+                GPOINTER_TO_SIZE(stm) | 1))
+          {
+            ctrans_stm_conflict(pTrans, stm);
+          }
+        if (stm->n_owned == stm->owned_capacity)
+          {
+            stm->owned_capacity = MAX(2 * stm->owned_capacity, 16);
+            stm->owned = g_realloc(stm->owned, stm->owned_capacity * sizeof(CtransStmOwned));
+          }
+        stm->owned[stm->n_owned].lock    = lock;
+        stm->owned[stm->n_owned].version = CTRANS_STM_VERSION(word);
+        stm->n_owned++;
+      }
+    ctrans_undo_save(pTrans, cell, sizeof(gsize));
+    g_atomic_pointer_set(cell, value);
+}
+
+gpointer
+ctrans_stm_read_pointer (Transaction* pTrans, gpointer const* cell)
+{
+    return GSIZE_TO_POINTER(ctrans_stm_read(pTrans, (const gsize*)cell));
+}
+
+void
+ctrans_stm_write_pointer (Transaction* pTrans, gpointer* cell, gpointer value)
+{
+    ctrans_stm_write(pTrans, (gsize*)cell, GPOINTER_TO_SIZE(value));
+}
@@ -0,0 +1,370 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "libctrans_threadpool.h"
+
+/*
+ * Microseconds a joining thread sleeps before looking again for tasks
+ * to run. Only matters when tasks are forked while every worker is
+ * blocked in a join.
+ */
+#define CTRANS_JOIN_POLL_US 1000
+
+typedef struct {
+    CtransPool* pool;
+    GThread*    thread;
+    GMutex      lock;  // protects tasks
+    GQueue      tasks; // owner pushes and pops at the tail, thieves take the head
+} CtransWorker;
+
+struct _CtransPool {
+    CtransWorker* workers;
+    guint         n_workers;
+    gint          n_queued;   // tasks in all the deques
+    gint          n_sleeping; // workers waiting on wakeup
+    gint          next;       // round robin for forks from other threads
+    GMutex        lock;       // protects stopping, used with wakeup
+    GCond         wakeup;
+    gboolean      stopping;
+};
+
+struct _CtransTaskGroup {
+    CtransPool*         pool;
+    gchar*              sDebug;
+    guint               flags;
+    CtransHandlerTable* handlers;
+    Transaction*        parent;
+    GMutex              lock;    // protects pending and exception
+    GCond               done;
+    gint                pending; // forked and not finished
+    gint                failed;  // read without the lock to skip tasks
+    recipient_exception exception; // copy of the first failure, texts owned
+};
+
+typedef struct {
+    GList            link; // in the deque of a worker
+    CtransTaskGroup* group;
+    CtransTaskFunc   fn;
+    gpointer         data;
+    Transaction*     trans;   // of the task, while it runs
+    gboolean         running; // inside fn: a rollback of the task savepoint is a failure
+} CtransTask;
+
+static GPrivate ctrans_current_worker; // CtransWorker* of the calling thread, if any
+
+static void
+ctrans_task_nop (G_GNUC_UNUSED Transaction* pTrans)
+{
+}
+
+/*
+ * Keeps a copy of exception if it's the first failure of the group.
+ */
+static void
+ctrans_task_group_fail (CtransTaskGroup* group, exception_base* exception)
+{
+    exception_base* copy = (exception_base*)&group->exception;
+    g_mutex_lock(&group->lock);
+    if (!group->failed)
+      {
+        g_free(copy->description_i18n);
+        g_free(copy->detail_i18n);
+        g_free(group->exception.solution_i18n);
+        *copy = *exception;
+        copy->description_i18n        = g_strdup(exception->description_i18n);
+        copy->detail_i18n             = g_strdup(exception->detail_i18n);
+        group->exception.solution_i18n =
+            g_strdup(((recipient_exception*)exception)->solution_i18n);
+        // They point to memory of the task, and the texts are formatted
+        memset(copy->args, 0, sizeof(copy->args));
+        g_atomic_int_set(&group->failed, TRUE);
+      }
+    g_mutex_unlock(&group->lock);
+}
+
+/*
+ * Cleanup registered in the savepoint of the task. When it's rolled
+ * back it runs before the memory of the task is released: the texts of
+ * the exception (or the arguments of its message) can still be read.
+ */
+static void
+ctrans_task_capture (gpointer data)
+{
+    CtransTask* task = data;
+    if (!task->running || task->trans->raisedException == NULL) return; // commit or restart
+    task->running = FALSE;
+    ctrans_format_exception(task->trans, task->trans->raisedException);
+    ctrans_task_group_fail(task->group, task->trans->raisedException);
+}
+
+/*
+ * Runs the task under a savepoint, so a failure is recorded in the
+ * group and the task transaction still commits normally.
+ */
+static void
+ctrans_task_run_one (CtransTask* task, Transaction* pTrans)
+{
+    CtransSavepoint sp;
+    NEWSAVEPOINT(pTrans, sp)
+      {
+        task->trans   = pTrans;
+        task->running = TRUE;
+        ctrans_defer(pTrans, ctrans_task_capture, task);
+        task->fn(pTrans, task->data);
+        task->running = FALSE;
+        RELEASESAVEPOINT(pTrans, sp);
+      }
+}
+
+static void
+ctrans_task_run (CtransTask* task)
+{
+    CtransTaskGroup* group = task->group;
+    if (!g_atomic_int_get(&group->failed))
+      {
+        Transaction* Task;
+        NEWTRANSACTION_FULL(Task, ctrans_task_nop, ctrans_task_nop, ctrans_task_nop,
+            group->sDebug, group->flags);
+        ctrans_set_handler_table(Task, group->handlers);
+        ctrans_task_run_one(task, Task);
+        ENDTRANSACTION(Task);
+      }
+    g_free(task);
+    // Under the lock: the group may be freed as soon as pending is 0
+    g_mutex_lock(&group->lock);
+    if (--group->pending == 0) g_cond_broadcast(&group->done);
+    g_mutex_unlock(&group->lock);
+}
+
+/*
+ * Takes a task: the newest of the own deque, else the oldest of
+ * another worker.
+ */
+static CtransTask*
+ctrans_pool_take (CtransPool* pool, CtransWorker* self)
+{
+    GList* link = NULL;
+    guint idx, first = 0;
+    if (g_atomic_int_get(&pool->n_queued) == 0) return NULL;
+    if (self != NULL)
+      {
+        g_mutex_lock(&self->lock);
+        link = g_queue_pop_tail_link(&self->tasks);
+        g_mutex_unlock(&self->lock);
+        first = self - pool->workers + 1;
+      }
+    for (idx = 0; link == NULL && idx < pool->n_workers; idx++)
+      {
+        CtransWorker* victim = &pool->workers[(first + idx) % pool->n_workers];
+        g_mutex_lock(&victim->lock);
+        link = g_queue_pop_head_link(&victim->tasks);
+        g_mutex_unlock(&victim->lock);
+      }
+    if (link == NULL) return NULL;
+    g_atomic_int_add(&pool->n_queued, -1);
+    return (CtransTask*)link;
+}
+
+static CtransWorker*
+ctrans_pool_self (CtransPool* pool)
+{
+    CtransWorker* worker = g_private_get(&ctrans_current_worker);
+    return (worker != NULL && worker->pool == pool) ? worker : NULL;
+}
+
+static gpointer
+ctrans_worker_main (gpointer data)
+{
+    CtransWorker* worker = data;
+    CtransPool* pool = worker->pool;
+    g_private_set(&ctrans_current_worker, worker);
+    while (TRUE)
+      {
+        gboolean stop;
+        CtransTask* task = ctrans_pool_take(pool, worker);
+        if (task != NULL)
+          {
+            ctrans_task_run(task);
+            continue;
+          }
+        g_mutex_lock(&pool->lock);
+        g_atomic_int_inc(&pool->n_sleeping);
+        while (g_atomic_int_get(&pool->n_queued) == 0 && !pool->stopping)
+          {
+            g_cond_wait(&pool->wakeup, &pool->lock);
+          }
+        g_atomic_int_add(&pool->n_sleeping, -1);
+        stop = pool->stopping && g_atomic_int_get(&pool->n_queued) == 0;
+        g_mutex_unlock(&pool->lock);
+        if (stop) break;
+      }
+    return NULL;
+}
+
+CtransPool*
+ctrans_pool_new (guint n_workers)
+{
+    CtransPool* pool = g_malloc0(sizeof(CtransPool));
+    guint idx;
+    if (n_workers == 0) n_workers = g_get_num_processors();
+    pool->workers   = g_malloc0(n_workers * sizeof(CtransWorker));
+    pool->n_workers = n_workers;
+    g_mutex_init(&pool->lock);
+    g_cond_init(&pool->wakeup);
+    for (idx = 0; idx < n_workers; idx++)
+      {
+        CtransWorker* worker = &pool->workers[idx];
+        worker->pool = pool;
+        g_mutex_init(&worker->lock);
+        g_queue_init(&worker->tasks);
+      }
+    for (idx = 0; idx < n_workers; idx++)
+      {
+        pool->workers[idx].thread = g_thread_new("ctrans-worker", ctrans_worker_main,
+            &pool->workers[idx]);
+      }
+    return pool;
+}
+
+void
+ctrans_pool_free (CtransPool* pool)
+{
+    guint idx;
+    g_mutex_lock(&pool->lock);
+    pool->stopping = TRUE;
+    g_cond_broadcast(&pool->wakeup);
+    g_mutex_unlock(&pool->lock);
+    for (idx = 0; idx < pool->n_workers; idx++)
+      {
+        g_thread_join(pool->workers[idx].thread);
+        g_mutex_clear(&pool->workers[idx].lock);
+      }
+    g_mutex_clear(&pool->lock);
+    g_cond_clear(&pool->wakeup);
+    g_free(pool->workers);
+    g_free(pool);
+}
+
+/*
+ * Waits until every task of the group ended, running queued tasks
+ * (of any group) in the meantime.
+ */
+static void
+ctrans_task_group_wait (CtransTaskGroup* group)
+{
+    CtransWorker* self = ctrans_pool_self(group->pool);
+    while (TRUE)
+      {
+        CtransTask* task;
+        gboolean finished;
+        g_mutex_lock(&group->lock);
+        finished = (group->pending == 0);
+        g_mutex_unlock(&group->lock);
+        if (finished) return;
+        task = ctrans_pool_take(group->pool, self);
+        if (task != NULL)
+          {
+            ctrans_task_run(task);
+            continue;
+          }
+        g_mutex_lock(&group->lock);
+        if (group->pending > 0)
+          {
+            g_cond_wait_until(&group->done, &group->lock,
+                g_get_monotonic_time() + CTRANS_JOIN_POLL_US);
+          }
+        g_mutex_unlock(&group->lock);
+      }
+}
+
+/*
+ * Cleanup of the parent: cancels the tasks not started yet and waits
+ * for the running ones.
+ */
+static void
+ctrans_task_group_free (gpointer data)
+{
+    CtransTaskGroup* group = data;
+    g_atomic_int_set(&group->failed, TRUE);
+    ctrans_task_group_wait(group);
+    g_free(((exception_base*)&group->exception)->description_i18n);
+    g_free(((exception_base*)&group->exception)->detail_i18n);
+    g_free(group->exception.solution_i18n);
+    g_mutex_clear(&group->lock);
+    g_cond_clear(&group->done);
+    g_free(group->sDebug);
+    g_free(group);
+}
+
+CtransTaskGroup*
+ctrans_task_group_new (Transaction* pParent, CtransPool* pool, const gchar* sDebug,
+    guint flags)
+{
+    CtransTaskGroup* group = g_malloc0(sizeof(CtransTaskGroup));
+    group->pool     = pool;
+    group->sDebug   = g_strdup(sDebug);
+    group->flags    = flags;
+    group->handlers = pParent->handlers;
+    group->parent   = pParent;
+    g_mutex_init(&group->lock);
+    g_cond_init(&group->done);
+    ctrans_defer(pParent, ctrans_task_group_free, group);
+    return group;
+}
+
+void
+ctrans_fork (CtransTaskGroup* group, CtransTaskFunc fn, gpointer data)
+{
+    CtransPool* pool = group->pool;
+    CtransWorker* worker = ctrans_pool_self(pool);
+    CtransTask* task = g_malloc(sizeof(CtransTask));
+    task->link.data = task;
+    task->link.next = NULL;
+    task->link.prev = NULL;
+    task->group = group;
+    task->fn    = fn;
+    task->data  = data;
+    g_mutex_lock(&group->lock);
+    group->pending++;
+    g_mutex_unlock(&group->lock);
+    if (worker == NULL)
+      {
+        worker = &pool->workers[(guint)g_atomic_int_add(&pool->next, 1) % pool->n_workers];
+      }
+    g_mutex_lock(&worker->lock);
+    g_queue_push_tail_link(&worker->tasks, &task->link);
+    g_mutex_unlock(&worker->lock);
+    g_atomic_int_inc(&pool->n_queued);
+    if (g_atomic_int_get(&pool->n_sleeping) > 0)
+      {
+        g_mutex_lock(&pool->lock);
+        g_cond_signal(&pool->wakeup);
+        g_mutex_unlock(&pool->lock);
+      }
+}
+
+void
+ctrans_join (CtransTaskGroup* group)
+{
+    ctrans_task_group_wait(group);
+    if (group->failed)
+      {
+        g_atomic_int_set(&group->failed, FALSE);
+        ctrans_raise_copy(group->parent, (exception_base*)&group->exception);
+      }
+}
@@ -0,0 +1,513 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#define _GNU_SOURCE // O_CLOEXEC
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libctrans_wal.h"
+
+/*
+ * A frame holds the records of one transaction:
+ *   CtransLogHeader, then for each record a CtransLogHeader (crc unused)
+ *   and the record padded to 8 bytes.
+ * The crc of a frame covers its n_bytes and the records.
+ */
+typedef struct {
+    guint32 n_bytes; // following the header
+    guint32 crc;
+} CtransLogHeader;
+
+#define CTRANS_LOG_ALIGN(n)   (((gsize)(n) + 7) & ~(gsize)7)
+#define CTRANS_LOG_FRAME_MAX  G_MAXUINT32
+
+/*
+ * Larger buffers are freed after use instead of being kept for the
+ * next transaction (or the next batch).
+ */
+#define CTRANS_LOG_KEEP       (64*1024)
+#define CTRANS_LOG_BATCH_KEEP (1024*1024)
+
+typedef struct {
+    guint8* data;
+    gsize   used;
+    gsize   capacity;
+} CtransLogBatch;
+
+struct _CtransLog {
+    int             fd;
+    gchar*          path;
+    GMutex          mutex;
+    GCond           synced_cond;
+    CtransLogBatch  batches[2];
+    CtransLogBatch* pending;  // frames waiting for the next sync
+    guint64         appended; // size of the file once the pending frames are written
+    guint64         synced;   // size of the file on disk
+    gboolean        syncing;  // a committer is writing and syncing a batch
+    int             error;    // errno of a failed write or sync: the log is unusable
+};
+
+typedef struct _CtransLogBuffer CtransLogBuffer;
+
+/*
+ * Frame being built by an outermost transaction. It's the argument of
+ * the prepare hook of the transaction, there is one per log used.
+ */
+struct _CtransLogBuffer {
+    CtransLog*       log;
+    Transaction*     root;
+    guint8*          data;     // the CtransLogHeader of the frame, then the records
+    gsize            used;
+    gsize            capacity;
+    gboolean         last;     // the hook registered again, to run after the others
+    CtransLogBuffer* next_free;
+};
+
+static guint32 ctrans_log_crc_table[256];
+
+static void ctrans_log_thread_free (gpointer data);
+static GPrivate ctrans_log_free_buffers = G_PRIVATE_INIT(ctrans_log_thread_free);
+
+static void ctrans_log_prepare (Transaction* pTrans, gpointer arg);
+
+static void
+ctrans_log_crc_init (void)
+{
+    static gsize done = 0;
+    guint32 crc, idx, bit;
+    if (!g_once_init_enter(&done)) return;
+    for (idx = 0; idx < 256; idx++)
+      {
+        crc = idx;
+        for (bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+        ctrans_log_crc_table[idx] = crc;
+      }
+    g_once_init_leave(&done, 1);
+}
+
+/*
+ * CRC32 (IEEE 802.3) of the n_bytes and the records of a frame.
+ */
+static guint32
+ctrans_log_crc (const CtransLogHeader* header)
+{
+    const guint8* bytes = (const guint8*)&header->n_bytes;
+    guint32 crc = 0xFFFFFFFF;
+    gsize idx;
+    for (idx = 0; idx < sizeof(header->n_bytes); idx++)
+      {
+        crc = ctrans_log_crc_table[(crc ^ bytes[idx]) & 0xFF] ^ (crc >> 8);
+      }
+    bytes = (const guint8*)(header + 1);
+    for (idx = 0; idx < header->n_bytes; idx++)
+      {
+        crc = ctrans_log_crc_table[(crc ^ bytes[idx]) & 0xFF] ^ (crc >> 8);
+      }
+    return crc ^ 0xFFFFFFFF;
+}
+
+/*
+ * A frame read back is used if its crc matches and its records fit in it.
+ */
+static gboolean
+ctrans_log_frame_valid (const CtransLogHeader* frame)
+{
+    const CtransLogHeader* record;
+    gsize at;
+    if (ctrans_log_crc(frame) != frame->crc) return FALSE;
+    for (at = 0; at < frame->n_bytes; at += sizeof(CtransLogHeader) + CTRANS_LOG_ALIGN(record->n_bytes))
+      {
+        record = (const CtransLogHeader*)((const guint8*)(frame + 1) + at);
+        if (frame->n_bytes - at < sizeof(CtransLogHeader) + CTRANS_LOG_ALIGN(record->n_bytes)) return FALSE;
+      }
+    return TRUE;
+}
+
+static void
+ctrans_log_thread_free (gpointer data)
+{
+    CtransLogBuffer* buffer = data;
+    while (buffer != NULL)
+      {
+        CtransLogBuffer* next = buffer->next_free;
+        g_free(buffer->data);
+        g_free(buffer);
+        buffer = next;
+      }
+}
+
+static int
+ctrans_log_write_all (int fd, const guint8* data, gsize n_bytes)
+{
+    while (n_bytes > 0)
+      {
+        gssize written = write(fd, data, n_bytes);
+        if (written < 0)
+          {
+            if (errno == EINTR) continue;
+            return errno;
+          }
+        data    += written;
+        n_bytes -= written;
+      }
+    return 0;
+}
+
+static gboolean
+ctrans_log_read_all (int fd, guint8* data, gsize n_bytes, guint64 offset)
+{
+    while (n_bytes > 0)
+      {
+        gssize done = pread(fd, data, n_bytes, offset);
+        if (done < 0 && errno == EINTR) continue;
+        if (done <= 0) return FALSE;
+        data    += done;
+        n_bytes -= done;
+        offset  += done;
+      }
+    return TRUE;
+}
+
+/*
+ * Replays the frames of the file and cuts what follows the last valid
+ * one. Returns the size kept, or -1 (errno set) if the file can't be
+ * read.
+ */
+static gint64
+ctrans_log_recover (int fd, CtransLogReplayFunc replay, gpointer data)
+{
+    struct stat st;
+    CtransLogHeader* frame = NULL;
+    gsize capacity = 0;
+    guint64 offset = 0;
+    if (fstat(fd, &st) != 0) return -1;
+    while (offset + sizeof(CtransLogHeader) <= (guint64)st.st_size)
+      {
+        CtransLogHeader header;
+        const CtransLogHeader* record;
+        gsize at;
+        if (!ctrans_log_read_all(fd, (guint8*)&header, sizeof(header), offset)) break;
+        // a frame is never empty: zeros are the tail of an interrupted write
+        if (header.n_bytes == 0 || header.n_bytes > st.st_size - offset - sizeof(header)) break;
+        if (capacity < sizeof(header) + header.n_bytes)
+          {
+            capacity = sizeof(header) + header.n_bytes;
+            frame = g_realloc(frame, capacity);
+          }
+        *frame = header;
+        if (!ctrans_log_read_all(fd, (guint8*)(frame + 1), header.n_bytes, offset + sizeof(header))) break;
+        if (!ctrans_log_frame_valid(frame)) break;
+        for (at = 0; at < header.n_bytes; at += sizeof(CtransLogHeader) + CTRANS_LOG_ALIGN(record->n_bytes))
+          {
+            record = (const CtransLogHeader*)((const guint8*)(frame + 1) + at);
+            if (replay != NULL) replay(record + 1, record->n_bytes, data);
+          }
+        offset += sizeof(header) + header.n_bytes;
+      }
+    g_free(frame);
+    if (offset < (guint64)st.st_size)
+      {
+        if (ftruncate(fd, offset) != 0 || fdatasync(fd) != 0) return -1;
+      }
+    return offset;
+}
+
+/*
+ * A new file is only there after a crash once its directory is synced.
+ */
+static int
+ctrans_log_sync_dir (const gchar* path)
+{
+    gchar* dir = g_path_get_dirname(path);
+    int fd = open(dir, O_RDONLY | O_CLOEXEC);
+    int error = 0;
+    g_free(dir);
+    if (fd < 0 || fsync(fd) != 0) error = errno;
+    if (fd >= 0) close(fd);
+    return error;
+}
+
+CtransLog*
+ctrans_log_open (const gchar* path, CtransLogReplayFunc replay, gpointer data,
+    GError** error)
+{
+    CtransLog* log;
+    gint64 size;
+    int fd, saved;
+    ctrans_log_crc_init();
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+      {
+        saved = errno;
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved),
+            "%s: %s", path, g_strerror(saved));
+        return NULL;
+      }
+    size  = ctrans_log_recover(fd, replay, data);
+    saved = (size < 0) ? errno : (size == 0) ? ctrans_log_sync_dir(path) : 0;
+    if (saved != 0)
+      {
+        close(fd);
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved),
+            "%s: %s", path, g_strerror(saved));
+        return NULL;
+      }
+    log = g_malloc0(sizeof(CtransLog));
+    log->fd       = fd;
+    log->path     = g_strdup(path);
+    log->pending  = &log->batches[0];
+    log->appended = size;
+    log->synced   = size;
+    g_mutex_init(&log->mutex);
+    g_cond_init(&log->synced_cond);
+    return log;
+}
+
+void
+ctrans_log_close (CtransLog* log)
+{
+    if (log == NULL) return;
+    close(log->fd);
+    g_mutex_clear(&log->mutex);
+    g_cond_clear(&log->synced_cond);
+    g_free(log->batches[0].data);
+    g_free(log->batches[1].data);
+    g_free(log->path);
+    g_free(log);
+}
+
+gboolean
+ctrans_log_truncate (CtransLog* log, GError** error)
+{
+    int saved = 0;
+    g_mutex_lock(&log->mutex);
+    // what is committing now was committed before the call
+    while (log->syncing || log->synced < log->appended)
+      {
+        g_cond_wait(&log->synced_cond, &log->mutex);
+      }
+    if (log->error != 0)
+      {
+        saved = log->error;
+      }
+    else if (ftruncate(log->fd, 0) != 0 || fdatasync(log->fd) != 0)
+      {
+        saved = log->error = errno;
+      }
+    else
+      {
+        log->appended = 0;
+        log->synced   = 0;
+      }
+    g_mutex_unlock(&log->mutex);
+    if (saved != 0)
+      {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved),
+            "%s: %s", log->path, g_strerror(saved));
+        return FALSE;
+      }
+    return TRUE;
+}
+
+/*
+ * Queues a frame and returns once it's on disk (0) or it failed (errno).
+ * The committer that finds nobody syncing writes every frame queued so
+ * far and syncs them, the others wait for it.
+ */
+static int
+ctrans_log_commit (CtransLog* log, const guint8* frame, gsize n_bytes)
+{
+    CtransLogBatch* batch;
+    guint64 end, target;
+    int error;
+    g_mutex_lock(&log->mutex);
+    if (log->error != 0)
+      {
+        error = log->error;
+        g_mutex_unlock(&log->mutex);
+        return error;
+      }
+    batch = log->pending;
+    if (batch->used + n_bytes > batch->capacity)
+      {
+        batch->capacity = MAX(2 * batch->capacity, batch->used + n_bytes);
+        batch->data = g_realloc(batch->data, batch->capacity);
+      }
+    memcpy(batch->data + batch->used, frame, n_bytes);
+    batch->used += n_bytes;
+    log->appended += n_bytes;
+    end = log->appended;
+    while (log->synced < end && log->error == 0)
+      {
+        if (log->syncing)
+          {
+            g_cond_wait(&log->synced_cond, &log->mutex);
+            continue;
+          }
+        batch = log->pending;
+        log->pending = (batch == &log->batches[0]) ? &log->batches[1] : &log->batches[0];
+        target = log->appended;
+        log->syncing = TRUE;
+        g_mutex_unlock(&log->mutex);
+        error = ctrans_log_write_all(log->fd, batch->data, batch->used);
+        if (error == 0 && fdatasync(log->fd) != 0) error = errno;
+        // don't leave behind frames of transactions that are told they failed
+        if (error != 0 && ftruncate(log->fd, log->synced) == 0) fdatasync(log->fd);
+        if (batch->capacity > CTRANS_LOG_BATCH_KEEP)
+          {
+            g_free(batch->data);
+            batch->data     = NULL;
+            batch->capacity = 0;
+          }
+        batch->used = 0;
+        g_mutex_lock(&log->mutex);
+        log->syncing = FALSE;
+        if (error != 0) log->error = error;
+        else log->synced = target;
+        g_cond_broadcast(&log->synced_cond);
+      }
+    error = (log->synced >= end) ? 0 : log->error;
+    g_mutex_unlock(&log->mutex);
+    return error;
+}
+
+/*
+ * Cleanup of the outermost transaction (or of the savepoint the buffer
+ * was created after): the buffer goes back to the thread.
+ */
+static void
+ctrans_log_end (gpointer data)
+{
+    CtransLogBuffer* buffer = data;
+    Transaction* root = buffer->root;
+    guint idx;
+    for (idx = 0; idx < root->n_prepare; idx++)
+      {
+        if (root->prepare[idx].arg != buffer) continue;
+        root->n_prepare--;
+        memmove(&root->prepare[idx], &root->prepare[idx + 1],
+            (root->n_prepare - idx) * sizeof(CtransPrepareHook));
+        break;
+      }
+    if (buffer->capacity > CTRANS_LOG_KEEP)
+      {
+        g_free(buffer->data);
+        buffer->data     = NULL;
+        buffer->capacity = 0;
+      }
+    buffer->next_free = g_private_get(&ctrans_log_free_buffers);
+    g_private_set(&ctrans_log_free_buffers, buffer);
+}
+
+/*
+ * Commit of the outermost transaction. The first call only registers
+ * the hook again so the frame is written after the other hooks ran.
+ */
+static void
+ctrans_log_prepare (Transaction* pTrans, gpointer arg)
+{
+    CtransLogBuffer* buffer = arg;
+    CtransLogHeader* header = (CtransLogHeader*)buffer->data;
+    int error;
+    if (!buffer->last)
+      {
+        buffer->last = TRUE;
+        ctrans_on_prepare(pTrans, ctrans_log_prepare, buffer);
+        return;
+      }
+    if (buffer->used == sizeof(CtransLogHeader)) return; // rolled back to savepoints
+    header->n_bytes = buffer->used - sizeof(CtransLogHeader);
+    header->crc     = ctrans_log_crc(header);
+    error = ctrans_log_commit(buffer->log, buffer->data, buffer->used);
+    if (error != 0)
+      {
+        ctrans_raise_sender_exception(pTrans, CTRANS_LOG_FAILED,
+            "log write failed", (char*)g_strerror(error));
+      }
+}
+
+/*
+ * Frame of the outermost transaction of pTrans for log, created at the
+ * first append.
+ */
+static CtransLogBuffer*
+ctrans_log_buffer (Transaction* pTrans, CtransLog* log)
+{
+    CtransLogBuffer* buffer;
+    Transaction* root = pTrans;
+    guint idx;
+    while (root->parent != 0) root = root->parent;
+    for (idx = 0; idx < root->n_prepare; idx++)
+      {
+        buffer = root->prepare[idx].arg;
+        if (root->prepare[idx].fn == ctrans_log_prepare && buffer->log == log) return buffer;
+      }
+    buffer = g_private_get(&ctrans_log_free_buffers);
+    if (buffer != NULL)
+      {
+        g_private_set(&ctrans_log_free_buffers, buffer->next_free);
+      }
+    else
+      {
+        buffer = g_malloc0(sizeof(CtransLogBuffer));
+      }
+    if (buffer->capacity == 0)
+      {
+        buffer->capacity = 256;
+        buffer->data     = g_malloc(buffer->capacity);
+      }
+    buffer->log  = log;
+    buffer->root = root;
+    buffer->used = sizeof(CtransLogHeader);
+    buffer->last = FALSE;
+    ctrans_defer(root, ctrans_log_end, buffer);
+    // raises if root has no room for the hook: its records can't be lost silently
+    ctrans_on_prepare(root, ctrans_log_prepare, buffer);
+    return buffer;
+}
+
+void
+ctrans_log_append (Transaction* pTrans, CtransLog* log, gconstpointer record,
+    gsize n_bytes)
+{
+    CtransLogBuffer* buffer = ctrans_log_buffer(pTrans, log);
+    CtransLogHeader* header;
+    gsize needed = sizeof(CtransLogHeader) + CTRANS_LOG_ALIGN(n_bytes);
+    if (n_bytes > CTRANS_LOG_FRAME_MAX || buffer->used + needed > CTRANS_LOG_FRAME_MAX)
+      {
+        ctrans_raise_sender_exception(pTrans, CTRANS_LOG_FAILED,
+            "log frame too large", pTrans->sDebug);
+      }
+    if (buffer->used + needed > buffer->capacity)
+      {
+        buffer->capacity = MAX(2 * buffer->capacity, buffer->used + needed);
+        buffer->data = g_realloc(buffer->data, buffer->capacity);
+      }
+    // a rollback of pTrans (or of a savepoint) forgets the record
+    ctrans_undo_save(pTrans, &buffer->used, sizeof(buffer->used));
+    header = (CtransLogHeader*)(buffer->data + buffer->used);
+    header->n_bytes = n_bytes;
+    header->crc     = 0;
+    memcpy(header + 1, record, n_bytes);
+    memset((guint8*)(header + 1) + n_bytes, 0, CTRANS_LOG_ALIGN(n_bytes) - n_bytes);
+    buffer->used += needed;
+}
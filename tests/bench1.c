@@ -0,0 +1,355 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** @file bench1.c
+ *
+ * @brief Benchmark suite checking the performance claims of libctrans.h
+ *
+ * Cases:
+ * <ul>
+ * <li>start_commit: throughput of an empty NEWTRANSACTION/ENDTRANSACTION.</li>
+ * <li>unwind: latency of a commit (ctrans_finish_transaction) or raise
+ *     (ctrans_raise_sender_exception) done "depth" frames below
+ *     NEWTRANSACTION, from the call until transaction_stop/
+ *     exception_captured runs. It must stay flat as the depth grows.</li>
+ * <li>error_path: full cost of an error detected "depth" frames down and
+ *     handled at the top, using a transaction, return codes or GError.</li>
+ * <li>alloc: ctrans_try_malloc (tracked, arena and warm arena) versus malloc/free,
+ *     ALLOCS_PER_TRANS blocks per transaction.</li>
+ * <li>memory: resident memory before and after MEMORY_ITERATIONS
+ *     transactions that allocate and sometimes raise.</li>
+ * </ul>
+ *
+ * Results are printed as one JSON object per line, so they can be
+ * compared by scripts between library versions.
+ * Pass "quick" as first argument for a short run.
+ */
+#include <time.h>
+#include <unistd.h>
+#include <glib-2.0/glib.h>
+
+#include "libctrans.h"
+
+#define ALLOCS_PER_TRANS  100
+#define ALLOC_SIZE        64
+
+static int iterations        = 100000;
+static int memory_iterations = 2000000;
+
+static const int depths[] = { 1, 4, 16, 64, 256, 1024 };
+
+static gint64 unwind_start;
+static gint64 unwind_total;
+
+void nop(Transaction* pTrans);
+void unwind_end(Transaction* pTrans);
+
+static gint64
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (gint64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static glong
+resident_kb(void)
+{
+    glong size = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f == NULL) return -1;
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) resident = -1;
+    fclose(f);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static const char*
+mode_name(guint flags)
+{
+    if (flags & CTRANS_STACK_SNAPSHOT) return "snapshot";
+    if (flags & CTRANS_WARM_ARENA)     return "warm";
+    if (flags & CTRANS_ALLOC_ARENA)    return "arena";
+    return "default";
+}
+
+void
+nop(Transaction* pTrans)
+{
+}
+
+void
+unwind_end(Transaction* pTrans)
+{
+    unwind_total += now_ns() - unwind_start;
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+empty_transaction(guint flags)
+{
+    Transaction* Trans1;
+    NEWTRANSACTION_FULL(Trans1, nop, nop, nop, "start_commit", flags);
+    ENDTRANSACTION(Trans1);
+}
+
+static void
+bench_start_commit(guint flags)
+{
+    int idx;
+    gint64 start = now_ns();
+    for (idx = 0; idx < iterations; idx++)
+      {
+        empty_transaction(flags);
+      }
+    printf("{\"bench\":\"start_commit\",\"mode\":\"%s\",\"ns_per_op\":%.1f}\n",
+        mode_name(flags), (double)(now_ns() - start) / iterations);
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+ * Goes down "depth" frames and ends the transaction there.
+ */
+static void
+descend(Transaction* pTrans, int depth, gboolean bRaise)
+{
+    volatile guint32 frame[8]; // keep frames realistic and avoid tail calls
+    frame[0] = depth;
+    if (depth > 0)
+      {
+        descend(pTrans, depth - 1, bRaise);
+        frame[1] = frame[0];
+        return;
+      }
+    unwind_start = now_ns();
+    if (bRaise)
+      {
+        ctrans_raise_sender_exception(pTrans, 2000000, "bench", "");
+      }
+    ctrans_finish_transaction(pTrans);
+}
+
+static void
+run_depth(int depth, guint flags, gboolean bRaise)
+{
+    Transaction* Trans1;
+    NEWTRANSACTION_FULL(Trans1, nop, unwind_end, unwind_end, "unwind", flags);
+    descend(Trans1, depth, bRaise);
+    ENDTRANSACTION(Trans1);
+}
+
+static void
+bench_unwind(int depth, guint flags)
+{
+    int idx;
+    double commit_ns, raise_ns;
+    unwind_total = 0;
+    for (idx = 0; idx < iterations; idx++) run_depth(depth, flags, FALSE);
+    commit_ns = (double)unwind_total / iterations;
+    unwind_total = 0;
+    for (idx = 0; idx < iterations; idx++) run_depth(depth, flags, TRUE);
+    raise_ns = (double)unwind_total / iterations;
+    printf("{\"bench\":\"unwind\",\"mode\":\"%s\",\"depth\":%d,"
+        "\"commit_ns\":%.1f,\"raise_ns\":%.1f}\n",
+        mode_name(flags), depth, commit_ns, raise_ns);
+}
+
+/* ------------------------------------------------------------------ */
+
+static int
+descend_rc(int depth)
+{
+    volatile guint32 frame[8];
+    frame[0] = depth;
+    if (depth > 0)
+      {
+        int rc = descend_rc(depth - 1);
+        if (rc != 0) return rc;
+        frame[1] = frame[0];
+        return 0;
+      }
+    return -1;
+}
+
+static void
+descend_gerror(int depth, GError** error)
+{
+    volatile guint32 frame[8];
+    frame[0] = depth;
+    if (depth > 0)
+      {
+        GError* child_error = NULL;
+        descend_gerror(depth - 1, &child_error);
+        if (child_error != NULL)
+          {
+            g_propagate_error(error, child_error);
+            return;
+          }
+        frame[1] = frame[0];
+        return;
+      }
+    g_set_error(error, g_quark_from_static_string("bench"), 1, "bench");
+}
+
+static void
+bench_error_path(int depth)
+{
+    int idx;
+    gint64 start;
+    double ctrans_ns, rc_ns, gerror_ns;
+
+    start = now_ns();
+    for (idx = 0; idx < iterations; idx++) run_depth(depth, CTRANS_DEFAULT, TRUE);
+    ctrans_ns = (double)(now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (idx = 0; idx < iterations; idx++)
+      {
+        if (descend_rc(depth) != 0) nop(NULL);
+      }
+    rc_ns = (double)(now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (idx = 0; idx < iterations; idx++)
+      {
+        GError* error = NULL;
+        descend_gerror(depth, &error);
+        if (error != NULL) g_error_free(error);
+      }
+    gerror_ns = (double)(now_ns() - start) / iterations;
+
+    printf("{\"bench\":\"error_path\",\"depth\":%d,\"ctrans_ns\":%.1f,"
+        "\"return_code_ns\":%.1f,\"gerror_ns\":%.1f}\n",
+        depth, ctrans_ns, rc_ns, gerror_ns);
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+alloc_transaction(guint flags)
+{
+    int idx;
+    Transaction* Trans1;
+    NEWTRANSACTION_FULL(Trans1, nop, nop, nop, "alloc", flags);
+    for (idx = 0; idx < ALLOCS_PER_TRANS; idx++)
+      {
+        ctrans_try_malloc(Trans1, ALLOC_SIZE, TRUE);
+      }
+    ENDTRANSACTION(Trans1);
+}
+
+static void
+bench_alloc(void)
+{
+    int idx, idx2;
+    gint64 start;
+    int loops = iterations / 10;
+    gpointer blocks[ALLOCS_PER_TRANS];
+
+    start = now_ns();
+    for (idx = 0; idx < loops; idx++) alloc_transaction(CTRANS_DEFAULT);
+    printf("{\"bench\":\"alloc\",\"mode\":\"default\",\"ns_per_alloc\":%.1f}\n",
+        (double)(now_ns() - start) / loops / ALLOCS_PER_TRANS);
+
+    start = now_ns();
+    for (idx = 0; idx < loops; idx++) alloc_transaction(CTRANS_ALLOC_ARENA);
+    printf("{\"bench\":\"alloc\",\"mode\":\"arena\",\"ns_per_alloc\":%.1f}\n",
+        (double)(now_ns() - start) / loops / ALLOCS_PER_TRANS);
+
+    start = now_ns();
+    for (idx = 0; idx < loops; idx++) alloc_transaction(CTRANS_WARM_ARENA);
+    printf("{\"bench\":\"alloc\",\"mode\":\"warm\",\"ns_per_alloc\":%.1f}\n",
+        (double)(now_ns() - start) / loops / ALLOCS_PER_TRANS);
+
+    start = now_ns();
+    for (idx = 0; idx < loops; idx++)
+      {
+        for (idx2 = 0; idx2 < ALLOCS_PER_TRANS; idx2++)
+          {
+            blocks[idx2] = malloc(ALLOC_SIZE);
+          }
+        for (idx2 = 0; idx2 < ALLOCS_PER_TRANS; idx2++)
+          {
+            free(blocks[idx2]);
+          }
+      }
+    printf("{\"bench\":\"alloc\",\"mode\":\"malloc\",\"ns_per_alloc\":%.1f}\n",
+        (double)(now_ns() - start) / loops / ALLOCS_PER_TRANS);
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+memory_transaction(int iteration, guint flags)
+{
+    int idx;
+    Transaction* Trans1;
+    NEWTRANSACTION_FULL(Trans1, nop, nop, nop, "memory", flags);
+    for (idx = 0; idx < 10; idx++)
+      {
+        ctrans_try_malloc(Trans1, ALLOC_SIZE, TRUE);
+      }
+    if (iteration % 10 == 0)
+      {
+        ctrans_raise_recipient_exception(Trans1, USER, "memory", "", "");
+      }
+    ENDTRANSACTION(Trans1);
+}
+
+static void
+bench_memory(guint flags)
+{
+    int idx;
+    glong rss_start, rss_end;
+    for (idx = 0; idx < 1000; idx++) memory_transaction(idx, flags); // warm up
+    rss_start = resident_kb();
+    for (idx = 0; idx < memory_iterations; idx++) memory_transaction(idx, flags);
+    rss_end = resident_kb();
+    printf("{\"bench\":\"memory\",\"mode\":\"%s\",\"iterations\":%d,"
+        "\"rss_start_kb\":%ld,\"rss_end_kb\":%ld}\n",
+        mode_name(flags), memory_iterations, rss_start, rss_end);
+}
+
+int
+main(int nargs, char** args)
+{
+    int idx;
+    if (nargs > 1 && strcmp(args[1], "quick") == 0)
+      {
+        iterations        /= 10;
+        memory_iterations /= 10;
+      }
+    bench_start_commit(CTRANS_DEFAULT);
+    bench_start_commit(CTRANS_ALLOC_ARENA);
+    bench_start_commit(CTRANS_STACK_SNAPSHOT);
+    for (idx = 0; idx < G_N_ELEMENTS(depths); idx++)
+      {
+        bench_unwind(depths[idx], CTRANS_DEFAULT);
+        bench_unwind(depths[idx], CTRANS_STACK_SNAPSHOT);
+      }
+    for (idx = 0; idx < G_N_ELEMENTS(depths); idx++)
+      {
+        bench_error_path(depths[idx]);
+      }
+    bench_alloc();
+    bench_memory(CTRANS_DEFAULT);
+    bench_memory(CTRANS_ALLOC_ARENA);
+    bench_memory(CTRANS_WARM_ARENA);
+    return 0;
+}
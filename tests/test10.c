@@ -0,0 +1,183 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** @file test10.c
+ *
+ * @brief Example of durable transactions (write-ahead log with group commit).
+ *
+ * N_THREADS threads post deposits, each one in a transaction that
+ * appends a record to the log. Every tenth deposit is refused after
+ * its record was appended, and every deposit tries to add a bonus in a
+ * savepoint that is rolled back: none of those records reaches the file.
+ *
+ * The log is then opened again, as after a crash, and the replay must
+ * find the same balance. The commits of the threads share the fsyncs,
+ * see the commit rate printed.
+ *
+ * Last, a long-lived session writes to a log on a full disk (/dev/full)
+ * and is committed while suspended: the write fails, the commit raises
+ * CTRANS_LOG_FAILED and session_failed runs once.
+ */
+#include <glib-2.0/glib.h>
+
+#include "libctrans.h"
+#include "libctrans_wal.h"
+
+#define N_THREADS   8
+#define N_DEPOSITS  250
+
+typedef struct {
+    gint32 account;
+    gint32 amount;
+} Deposit;
+
+static CtransLog* ledger;
+
+void post_deposit(Transaction* pTrans, gint32 account, gint32 amount);
+gpointer run_deposits(gpointer data);
+void replay_deposit(gconstpointer record, gsize n_bytes, gpointer data);
+void run_failing_session();
+void session_failed(Transaction* pTrans);
+
+void exception_captured(Transaction* pTrans);
+void transaction_start (Transaction* pTrans);
+void transaction_stop  (Transaction* pTrans);
+
+void
+post_deposit(Transaction* pTrans, gint32 account, gint32 amount)
+{
+    Deposit deposit = { account, amount };
+    CtransSavepoint sp;
+    ctrans_log_append(pTrans, ledger, &deposit, sizeof(deposit));
+    NEWSAVEPOINT(pTrans, sp)
+      {
+        deposit.amount = 1000;
+        ctrans_log_append(pTrans, ledger, &deposit, sizeof(deposit));
+        ctrans_raise_sender_exception(pTrans, 2000001, "no bonus", "bonus not posted");
+      }
+    if (amount % 10 == 9)
+      {
+        ctrans_raise_sender_exception(pTrans, INVALID_ARGUMENT | 2000002,
+            "deposit refused", "amount ending in 9");
+      }
+}
+
+gpointer
+run_deposits(gpointer data)
+{
+    volatile int idx; // kept across the longjmp of the refused deposits
+    for (idx = 0; idx < N_DEPOSITS; idx++)
+      {
+                    Transaction* Trans1;
+                    NEWTRANSACTION(Trans1, transaction_start, transaction_stop, exception_captured,"deposit");
+        post_deposit(Trans1, GPOINTER_TO_INT(data), idx);
+                    ENDTRANSACTION(Trans1);
+      }
+    return NULL;
+}
+
+void
+replay_deposit(gconstpointer record, gsize n_bytes, gpointer data)
+{
+    const Deposit* deposit = record;
+    *(gint64*)data += deposit->amount;
+}
+
+void
+run_failing_session()
+{
+    static Transaction* Session;
+    Deposit deposit = { 0, 42 };
+    GError* error = NULL;
+    CtransLog* full = ctrans_log_open("/dev/full", NULL, NULL, &error);
+    if (full == NULL)
+      {
+        printf("cannot open /dev/full: %s\n", error->message);
+        g_error_free(error);
+        return;
+      }
+                    NEWLONGTRANSACTION(Session, transaction_start, transaction_stop, session_failed,
+                        "session", CTRANS_DEFAULT);
+    ctrans_log_append(Session, full, &deposit, sizeof(deposit));
+                    SUSPENDTRANSACTION(Session);
+    ctrans_finish_transaction(Session);
+    ctrans_log_close(full);
+}
+
+int
+main(int nargs, char** args)
+{
+    gchar* path = g_build_filename(g_get_tmp_dir(), "ctrans_test10.log", NULL);
+    GThread* threads[N_THREADS];
+    GError* error = NULL;
+    gint64 balance = 0, expected = 0, start;
+    int idx;
+    ledger = ctrans_log_open(path, replay_deposit, &balance, &error);
+    if (ledger == NULL || !ctrans_log_truncate(ledger, &error))
+      {
+        printf("cannot use the log: %s\n", error->message);
+        return 1;
+      }
+    start = g_get_monotonic_time();
+    for (idx = 0; idx < N_THREADS; idx++)
+      {
+        threads[idx] = g_thread_new("deposits", run_deposits, GINT_TO_POINTER(idx));
+      }
+    for (idx = 0; idx < N_THREADS; idx++) g_thread_join(threads[idx]);
+    printf("%.0f commits per second\n",
+        N_THREADS * N_DEPOSITS * 0.9 * G_USEC_PER_SEC / (g_get_monotonic_time() - start + 1));
+    ctrans_log_close(ledger);
+
+    for (idx = 0; idx < N_DEPOSITS; idx++) if (idx % 10 != 9) expected += N_THREADS * idx;
+    balance = 0;
+    ledger = ctrans_log_open(path, replay_deposit, &balance, &error);
+    if (ledger == NULL)
+      {
+        printf("cannot reopen the log: %s\n", error->message);
+        return 1;
+      }
+    printf("replayed balance: %" G_GINT64_FORMAT " (expected %" G_GINT64_FORMAT ")\n",
+        balance, expected);
+    ctrans_log_close(ledger);
+    g_free(path);
+    run_failing_session();
+    return 0;
+}
+
+void
+session_failed(Transaction* pTrans)
+{
+    printf("********     Exception Captured: %s (%s)  ********\n",
+        pTrans->raisedException->description_i18n,
+        pTrans->raisedException->detail_i18n);
+}
+
+void
+exception_captured(Transaction* pTrans)
+{
+}
+
+void
+transaction_start(Transaction* pTrans)
+{
+}
+
+void
+transaction_stop(Transaction* pTrans)
+{
+}
@@ -0,0 +1,96 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** @file test11.c
+ *
+ * @brief Example of long-lived transactions using shared data (STM).
+ *
+ * A booking session reads the price, reserves a seat and is suspended
+ * waiting for the user. Each session is committed while suspended.
+ * The first one is left alone and commits. During the second one
+ * another thread changes the price: the commit finds the conflict, the
+ * session can't restart, so it raises CTRANS_STM_CONFLICT. The seat is
+ * given back by the undo log and exception_captured runs once.
+ */
+#include <glib-2.0/glib.h>
+
+#include "libctrans.h"
+#include "libctrans_stm.h"
+
+static gsize price = 100;
+static gsize seats = 10;
+
+gpointer change_price(gpointer data);
+void run_session(gboolean price_changes);
+
+void exception_captured(Transaction* pTrans);
+void transaction_start (Transaction* pTrans);
+void transaction_stop  (Transaction* pTrans);
+
+gpointer
+change_price(gpointer data)
+{
+                    Transaction* Trans1;
+                    NEWTRANSACTION(Trans1, transaction_start, transaction_stop, exception_captured,"pricing");
+    ctrans_stm_write(Trans1, &price, ctrans_stm_read(Trans1, &price) + 20);
+                    ENDTRANSACTION(Trans1);
+    return NULL;
+}
+
+void
+run_session(gboolean price_changes)
+{
+    static Transaction* Session;
+    // on_open
+                    NEWLONGTRANSACTION(Session, transaction_start, transaction_stop, exception_captured,
+                        "booking", CTRANS_DEFAULT);
+    printf("quoted price %" G_GSIZE_FORMAT "\n", ctrans_stm_read(Session, &price));
+    ctrans_stm_write(Session, &seats, ctrans_stm_read(Session, &seats) - 1);
+                    SUSPENDTRANSACTION(Session);
+    // meanwhile
+    if (price_changes) g_thread_join(g_thread_new("pricing", change_price, NULL));
+    // on_confirm
+    ctrans_finish_transaction(Session);
+    printf("price %" G_GSIZE_FORMAT ", %" G_GSIZE_FORMAT " seats left\n", price, seats);
+}
+
+int
+main(int nargs, char** args)
+{
+    run_session(FALSE);
+    run_session(TRUE);
+    return 0;
+}
+
+void
+exception_captured(Transaction* pTrans)
+{
+    printf("********     Exception Captured: %s  ********\n",
+        pTrans->raisedException->description_i18n);
+}
+
+void
+transaction_start(Transaction* pTrans)
+{
+}
+
+void
+transaction_stop(Transaction* pTrans)
+{
+    printf("%s committed\n", pTrans->sDebug);
+}
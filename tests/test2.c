@@ -26,7 +26,10 @@
  * Extends test1.c
  *
  * Extends test1.c. Now a prototype main-loop start a new
- * transaction for each new event.
+ * transaction for each new event. Memory is served from the
+ * transaction arena. With CTRANS_WARM_ARENA the chunks of an event are
+ * kept for the next one, so past the first event no memory is
+ * requested to the system.
  * 
  */
 #include <glib-2.0/glib.h>
@@ -97,7 +100,8 @@ run_main_loop()
     while (TRUE)
       {
                     Transaction* Trans1;
-                    NEWTRANSACTION(Trans1, transaction_start, transaction_stop, exception_captured,"Trans1");
+                    NEWTRANSACTION_FULL(Trans1, transaction_start, transaction_stop, exception_captured,"Trans1",
+                        CTRANS_WARM_ARENA);
     action1(Trans1);
     action2(Trans1);
                     ENDTRANSACTION(Trans1);
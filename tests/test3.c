@@ -39,6 +39,9 @@
  * A transaction start/stop involves two different GUI events in this example.<br>
  * It's quite natural to associate a transaction to a user dialog (a user
  * filling e few forms in a row).
+ * Since the transaction ends in a different callback than the one that
+ * started it, it's a long-lived transaction (NEWLONGTRANSACTION): each
+ * callback resumes it, works on it and suspends it again.
  */
 
 typedef enum { HELLO, BYE, DELETE, DESTROY } action;
@@ -51,11 +54,39 @@ GtkWidget *window, *butHello, *butBye;
 GtkWidget *box1;
 
 static Transaction* Trans1;
+
+static void
+say_hello()
+{
+    NEWLONGTRANSACTION(Trans1, transaction_start, transaction_stop, exception_captured,
+       "trans Hello-Bye", CTRANS_DEFAULT);
+    g_print ("Hello World\n");
+    SUSPENDTRANSACTION(Trans1);
+}
+
+static void
+say_bye()
+{
+    static gint16 count  = 0;
+    if (Trans1 == NULL) return;
+    RESUMETRANSACTION(Trans1);
+    g_print ("Bye World\n");
+    count++;
+    if (count==10)
+      {
+        count=0;
+        recipEx_type type = USER;
+        ctrans_raise_recipient_exception(Trans1,type,
+            "count==10", "detail", "solution");
+      }
+    ctrans_finish_transaction(Trans1);
+    SUSPENDTRANSACTION(Trans1);
+}
+
 static gboolean 
 callback_control( GtkWidget *widget, GdkEvent  *event, gpointer data )
 {
     gboolean result = TRUE;
-    static gint16 count  = 0;
     if ( (*(action*)data) == DESTROY) 
       {
         gtk_main_quit ();
@@ -67,22 +98,11 @@ callback_control( GtkWidget *widget, GdkEvent  *event, gpointer data )
       } 
     else if ( (*(action*)data) == HELLO) 
       {
-        NEWTRANSACTION(Trans1, transaction_start, transaction_stop, exception_captured,
-           "trans Hello-Bye");
-        g_print ("Hello World\n");
+        say_hello();
       } 
     else if ( (*(action*)data) == BYE) 
       {
-         g_print ("Bye World\n");
-         count++;
-         if (count==10)
-           {
-             count=0;
-             recipEx_type type = USER;
-             ctrans_raise_recipient_exception(Trans1,type,
-                 "count==10", "detail", "solution");
-           }
-         ENDTRANSACTION(Trans1);
+         say_bye();
       } 
     else 
       {
@@ -0,0 +1,146 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** @file test4.c
+ *
+ * @brief Example of nested transactions and savepoints.
+ *
+ * run_batch starts a transaction and processes a few records. Each
+ * record is a step protected by a savepoint: when process_record
+ * raises an exception only the memory it allocated is released and
+ * the step is retried (up to MAX_RETRIES times).
+ *
+ * Each record registers a cleanup with ctrans_defer. It runs as soon
+ * as the step is rolled back, or when the batch ends. The counter of
+ * processed records is updated with CTRANS_WRITE, so the increments of
+ * the failed attempts are undone by the rollback.
+ *
+ * Finally a child transaction is started inside the parent. The parent
+ * is committed from inside the child, so the child is ended together
+ * with the parent.
+ *
+ * At exit the statistics kept by the library are printed per
+ * transaction name.
+ */
+#include <glib-2.0/glib.h>
+
+#include "libctrans.h"
+
+#define MAX_RETRIES 3
+
+static int processed = 0;
+
+void close_record(gpointer record);
+void process_record(Transaction* pTrans, int record, int attempt);
+void run_batch();
+void print_stats(const gchar* sDebug, const CtransStats* stats, gpointer user_data);
+
+void exception_captured(Transaction* pTrans);
+void transaction_start (Transaction* pTrans);
+void transaction_stop  (Transaction* pTrans);
+
+void
+close_record(gpointer record)
+{
+    printf("record %d closed\n", GPOINTER_TO_INT(record));
+}
+
+void
+process_record(Transaction* pTrans, int record, int attempt)
+{
+    gpointer gp = ctrans_try_malloc(pTrans, 1000, TRUE) ;
+    ctrans_defer(pTrans, close_record, GINT_TO_POINTER(record));
+    CTRANS_WRITE(pTrans, processed, processed + 1);
+    if (record == 2 && attempt < 2)
+      {
+        ctrans_raise_sender_exception(pTrans, 2000001,
+            "record 2 not ready", "retry later");
+      }
+    printf("record %d processed at attempt %d\n", record, attempt);
+}
+
+void
+run_batch()
+{
+                    Transaction* Trans1;
+                    NEWTRANSACTION_FULL(Trans1, transaction_start, transaction_stop, exception_captured,
+                        "batch", CTRANS_ALLOC_ARENA);
+    volatile int record; // read after the longjmp of a rollback
+    for (record = 0; record < 4; record++)
+      {
+        volatile int attempt;
+        for (attempt = 0; attempt < MAX_RETRIES; attempt++)
+          {
+            CtransSavepoint sp;
+            NEWSAVEPOINT(Trans1, sp)
+              {
+                process_record(Trans1, record, attempt);
+                RELEASESAVEPOINT(Trans1, sp);
+                break;
+              }
+            else
+              {
+                printf("record %d rolled back: %s\n", record,
+                    Trans1->raisedException->description_i18n);
+              }
+          }
+      }
+                    Transaction* Child1;
+                    NEWCHILDTRANSACTION(Child1, Trans1, transaction_start, transaction_stop, exception_captured,
+                        "child");
+    ctrans_try_malloc(Child1, 1000, TRUE);
+    ctrans_finish_transaction(Trans1); // Child1 is ended with its parent
+                    ENDTRANSACTION(Child1);
+                    ENDTRANSACTION(Trans1);
+}
+
+void
+print_stats(const gchar* sDebug, const CtransStats* stats, gpointer user_data)
+{
+    printf("%s: started %" G_GUINT64_FORMAT ", committed %" G_GUINT64_FORMAT
+        ", savepoint rollbacks %" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT
+        " bytes in %" G_GUINT64_FORMAT " allocs\n", sDebug, stats->started,
+        stats->committed, stats->savepoint_rollbacks, stats->alloc_bytes, stats->allocs);
+}
+
+int
+main(int nargs, char** args)
+{
+    run_batch();
+    printf("%d records processed\n", processed);
+    ctrans_stats_foreach(print_stats, NULL);
+    return 0;
+}
+
+void
+exception_captured(Transaction* pTrans)
+{
+    printf("\n********     Exception Captured: %s        ********\n", pTrans->sDebug);
+}
+
+void
+transaction_start(Transaction* pTrans)
+{
+    printf("\n********         TRANS_START: %s           ********\n", pTrans->sDebug);
+}
+
+void
+transaction_stop(Transaction* pTrans)
+{
+    printf("\n********         TRANS_STOP: %s            ********\n", pTrans->sDebug);
+}
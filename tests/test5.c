@@ -0,0 +1,126 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** @file test5.c
+ *
+ * @brief Example of exception classes and handler tables.
+ *
+ * A single handler table is built at startup and attached to the
+ * transaction of every event. Timeouts are counted and resumed by
+ * on_timeout, so the event continues in the same transaction.
+ * I/O errors go to on_io_error, which lets the transaction abort and
+ * exception_captured runs as usual.
+ *
+ * The exceptions are messages of the catalog: raising only stores the
+ * event number, and the texts are formatted by the handlers that print
+ * them. The resumed timeouts never build a string.
+ */
+#include <glib-2.0/glib.h>
+
+#include "libctrans.h"
+
+#define READ_TIMEOUT   (TIMEOUT     | 2000001)
+#define READ_FAILED    (IOEXCEPTION | 2000002)
+
+void read_input(Transaction* pTrans, int event);
+void run_main_loop();
+
+void exception_captured(Transaction* pTrans);
+void transaction_start (Transaction* pTrans);
+void transaction_stop  (Transaction* pTrans);
+
+static CtransHandlerTable* handlers;
+static CtransMessageId msg_read_timeout, msg_read_failed;
+static int timeouts = 0;
+
+static CtransHandlerResult
+on_timeout(Transaction* pTrans, exception_base* exception, gpointer user_data)
+{
+    timeouts++; // exception->args[0].i is the event, no need for the texts
+    return CTRANS_HANDLER_RESUME;
+}
+
+static CtransHandlerResult
+on_io_error(Transaction* pTrans, exception_base* exception, gpointer user_data)
+{
+    ctrans_format_exception(pTrans, exception);
+    printf("I/O error: %s (%s)\n", exception->description_i18n, exception->detail_i18n);
+    return CTRANS_HANDLER_ABORT;
+}
+
+void
+read_input(Transaction* pTrans, int event)
+{
+    gpointer gp = ctrans_try_malloc(pTrans, 1000, TRUE) ;
+    if (event % 3 == 0)
+      {
+        ctrans_raise_message(pTrans, msg_read_timeout, event);
+      }
+    if (event == 7)
+      {
+        ctrans_raise_message(pTrans, msg_read_failed, event, "/dev/input");
+      }
+    printf("event %d read (%d timeouts so far)\n", event, timeouts);
+}
+
+int
+main(int nargs, char** args)
+{
+    msg_read_timeout = ctrans_message_register("input.read_timeout", READ_TIMEOUT,
+        "read timed out", "event %d", NULL);
+    msg_read_failed  = ctrans_message_register("input.read_failed", READ_FAILED,
+        "read failed", "event %d, device %s", "check %2$s");
+    handlers = ctrans_handler_table_new();
+    ctrans_handler_table_set(handlers, TIMEOUT,     on_timeout,  NULL);
+    ctrans_handler_table_set(handlers, IOEXCEPTION, on_io_error, NULL);
+    run_main_loop();
+    ctrans_handler_table_free(handlers);
+    return 0;
+}
+
+void
+run_main_loop()
+{
+    volatile int event; // kept across the longjmp of an exception
+    for (event = 0; event < 10; event++)
+      {
+                    Transaction* Trans1;
+                    NEWTRANSACTION(Trans1, transaction_start, transaction_stop, exception_captured,"event");
+    ctrans_set_handler_table(Trans1, handlers);
+    read_input(Trans1, event);
+                    ENDTRANSACTION(Trans1);
+      }
+}
+
+void
+exception_captured(Transaction* pTrans)
+{
+    ctrans_format_exception(pTrans, pTrans->raisedException);
+    printf("********     Exception Captured: %s  ********\n",
+        pTrans->raisedException->description_i18n);
+}
+
+void
+transaction_start(Transaction* pTrans)
+{
+}
+
+void
+transaction_stop(Transaction* pTrans)
+{
+}
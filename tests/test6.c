@@ -0,0 +1,85 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** @file test6.c
+ *
+ * @brief Example of events dispatched by a GMainLoop inside transactions.
+ *
+ * Same main loop as test2.c, but the loop is a GMainLoop and the events
+ * are queued on a CtransEventSource. They are dispatched in batches of
+ * 4 events per transaction. Event 5 raises an exception: only its
+ * memory is released and on_event_error reports it, the rest of its
+ * batch commits as usual. Temporary strings are given back right away
+ * with ctrans_free instead of waiting for the end of the batch.
+ */
+#include <glib-2.0/glib.h>
+
+#include "libctrans_mainloop.h"
+
+#define N_EVENTS 10
+
+static GMainLoop* loop;
+
+void handle_event(Transaction* pTrans, gpointer event, gpointer user_data);
+void on_event_error(Transaction* pTrans, gpointer event, gpointer user_data);
+
+void
+handle_event(Transaction* pTrans, gpointer event, gpointer user_data)
+{
+    int number = *(int*)event;
+    gpointer gp = ctrans_try_malloc(pTrans, 1000, TRUE) ;
+    if (number == 5)
+      {
+        ctrans_raise_sender_exception(pTrans, INVALID_ARGUMENT | 2000005,
+            "event 5 is malformed", "");
+      }
+    gchar* line = ctrans_strdup_printf(pTrans, "event %d handled in transaction %u",
+        number, pTrans->id);
+    puts(line);
+    ctrans_free(pTrans, line); // not needed until the batch ends
+
+    if (number == N_EVENTS - 1) g_main_loop_quit(loop);
+}
+
+void
+on_event_error(Transaction* pTrans, gpointer event, gpointer user_data)
+{
+    printf("event %d failed in transaction %u: %s\n", *(int*)event, pTrans->id,
+        pTrans->raisedException->description_i18n);
+}
+
+int
+main(int nargs, char** args)
+{
+    int idx;
+    GSource* source = ctrans_event_source_new("events", CTRANS_ALLOC_ARENA, 4,
+        handle_event, on_event_error, g_free, NULL);
+    g_source_attach(source, NULL);
+    for (idx = 0; idx < N_EVENTS; idx++)
+      {
+        int* event = g_malloc(sizeof(int));
+        *event = idx;
+        ctrans_event_source_push(source, event);
+      }
+    loop = g_main_loop_new(NULL, FALSE);
+    g_main_loop_run(loop);
+    g_main_loop_unref(loop);
+    g_source_destroy(source);
+    g_source_unref(source);
+    return 0;
+}
@@ -0,0 +1,120 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** @file test7.c
+ *
+ * @brief Example of bulk record processing.
+ *
+ * A batch of orders is processed with ctrans_process_records inside a
+ * single transaction. Orders with a negative amount raise a recipient
+ * exception, its detail formatted in the memory of the order: only that
+ * memory is released and the exception, texts copied, is reported in
+ * its result. The batch still commits.
+ *
+ * Transactions named "orders" have a memory budget of 64KB. The big
+ * order needs a 1MB report, so it's rejected with CTRANS_BUDGET_EXCEEDED
+ * instead of growing the process.
+ */
+#include <glib-2.0/glib.h>
+
+#include "libctrans.h"
+
+typedef struct {
+    int   id;
+    float amount;
+} order;
+
+void process_order(Transaction* pTrans, gpointer record, gpointer user_data);
+void run_batch();
+
+void exception_captured(Transaction* pTrans);
+void transaction_start (Transaction* pTrans);
+void transaction_stop  (Transaction* pTrans);
+
+void
+process_order(Transaction* pTrans, gpointer record, gpointer user_data)
+{
+    order* pOrder = record;
+    gchar* invoice;
+    if (pOrder->amount < 0)
+      {
+        ctrans_raise_recipient_exception(pTrans, USER, "negative amount",
+            ctrans_strdup_printf(pTrans, "%.2f", pOrder->amount), "fix the order and send it again");
+      }
+    if (pOrder->amount > 1000)
+      {
+        gchar* report = ctrans_try_malloc(pTrans, 1024*1024, TRUE);
+        g_snprintf(report, 1024*1024, "report of order %d", pOrder->id);
+      }
+    invoice = ctrans_strdup_printf(pTrans, "invoice %d: %.2f", pOrder->id, pOrder->amount);
+    puts(invoice);
+    *(float*)user_data += pOrder->amount;
+}
+
+void
+run_batch()
+{
+    order orders[] = { {1, 10.0}, {2, 25.5}, {3, -4.0}, {4, 7.25}, {5, -1.0}, {6, 3.0},
+                       {7, 5000.0} };
+    float total = 0;
+    guint idx, n_failed;
+    CtransRecordResult* results;
+                    Transaction* Trans1;
+                    NEWTRANSACTION_FULL(Trans1, transaction_start, transaction_stop, exception_captured,
+                        "orders", CTRANS_ALLOC_ARENA);
+    results = ctrans_process_records(Trans1, orders, sizeof(order), G_N_ELEMENTS(orders),
+        process_order, &total, &n_failed);
+    for (idx = 0; idx < G_N_ELEMENTS(orders); idx++)
+      {
+        if (results[idx].failed)
+          {
+            printf("order %d rejected: %s %s (%s)\n", orders[idx].id,
+                results[idx].exception.parent.parent.description_i18n,
+                results[idx].exception.parent.parent.detail_i18n,
+                results[idx].exception.solution_i18n ? results[idx].exception.solution_i18n : "-");
+          }
+      }
+    printf("%u orders rejected, total %.2f\n", n_failed, total);
+                    ENDTRANSACTION(Trans1);
+}
+
+int
+main(int nargs, char** args)
+{
+    ctrans_set_name_budget("orders", 64*1024);
+    run_batch();
+    return 0;
+}
+
+void
+exception_captured(Transaction* pTrans)
+{
+    printf("\n********     Exception Captured: %s        ********\n", pTrans->sDebug);
+}
+
+void
+transaction_start(Transaction* pTrans)
+{
+    printf("\n********         TRANS_START: %s           ********\n", pTrans->sDebug);
+}
+
+void
+transaction_stop(Transaction* pTrans)
+{
+    printf("\n********         TRANS_STOP: %s            ********\n", pTrans->sDebug);
+}
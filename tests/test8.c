@@ -0,0 +1,126 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** @file test8.c
+ *
+ * @brief Example of fork-join on a thread pool.
+ *
+ * Each request sums the squares of N_VALUES numbers. The parent
+ * transaction splits the range into N_SLICES tasks and joins them;
+ * each task works in its own transaction, on another core, and writes
+ * its partial sum in a slot allocated by the parent before forking.
+ *
+ * A slice containing a negative number raises, with a detail formatted
+ * in the memory of the task. The exception reaches the parent at
+ * ctrans_join and exception_captured reports it, after the memory of
+ * every task was released.
+ */
+#include <glib-2.0/glib.h>
+
+#include "libctrans.h"
+#include "libctrans_threadpool.h"
+
+#define N_VALUES  100000
+#define N_SLICES  16
+
+typedef struct {
+    const gint* values;
+    gint        n_values;
+    gint64      sum;
+} Slice;
+
+void sum_slice(Transaction* pTrans, gpointer data);
+void run_request(CtransPool* pool, gint* values);
+
+void exception_captured(Transaction* pTrans);
+void transaction_start (Transaction* pTrans);
+void transaction_stop  (Transaction* pTrans);
+
+void
+sum_slice(Transaction* pTrans, gpointer data)
+{
+    Slice* slice = data;
+    gint64* squares = ctrans_try_malloc(pTrans, slice->n_values * sizeof(gint64), TRUE);
+    int idx;
+    slice->sum = 0;
+    for (idx = 0; idx < slice->n_values; idx++)
+      {
+        if (slice->values[idx] < 0)
+          {
+            ctrans_raise_sender_exception(pTrans, INVALID_ARGUMENT | 2000001, "negative value",
+                ctrans_strdup_printf(pTrans, "squares not computed: %d at %d",
+                    slice->values[idx], idx));
+          }
+        squares[idx] = (gint64)slice->values[idx] * slice->values[idx];
+        slice->sum += squares[idx];
+      }
+}
+
+void
+run_request(CtransPool* pool, gint* values)
+{
+                    Transaction* Trans1;
+                    NEWTRANSACTION(Trans1, transaction_start, transaction_stop, exception_captured,"request");
+    Slice* slices = ctrans_try_calloc(Trans1, N_SLICES, sizeof(Slice), TRUE);
+    CtransTaskGroup* group = ctrans_task_group_new(Trans1, pool, "slice", CTRANS_ALLOC_ARENA);
+    gint64 total = 0;
+    int idx;
+    for (idx = 0; idx < N_SLICES; idx++)
+      {
+        slices[idx].values   = values + idx * (N_VALUES / N_SLICES);
+        slices[idx].n_values = N_VALUES / N_SLICES;
+        ctrans_fork(group, sum_slice, &slices[idx]);
+      }
+    ctrans_join(group);
+    for (idx = 0; idx < N_SLICES; idx++) total += slices[idx].sum;
+    printf("sum of squares: %" G_GINT64_FORMAT "\n", total);
+                    ENDTRANSACTION(Trans1);
+}
+
+int
+main(int nargs, char** args)
+{
+    CtransPool* pool = ctrans_pool_new(0);
+    gint* values = g_malloc(N_VALUES * sizeof(gint));
+    int idx;
+    for (idx = 0; idx < N_VALUES; idx++) values[idx] = idx % 1000;
+    run_request(pool, values);
+    values[N_VALUES / 2 + 7] = -1;
+    run_request(pool, values);
+    g_free(values);
+    ctrans_pool_free(pool);
+    return 0;
+}
+
+void
+exception_captured(Transaction* pTrans)
+{
+    printf("********     Exception Captured: %s (%s)  ********\n",
+        pTrans->raisedException->description_i18n,
+        pTrans->raisedException->detail_i18n);
+}
+
+void
+transaction_start(Transaction* pTrans)
+{
+}
+
+void
+transaction_stop(Transaction* pTrans)
+{
+}
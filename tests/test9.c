@@ -0,0 +1,144 @@
+/* LIBCTRANS - Library of useful routines for transaction oriended programming in C
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/** @file test9.c
+ *
+ * @brief Example of shared data updated by transactions of several threads (STM).
+ *
+ * N_THREADS threads move money between N_ACCOUNTS accounts, each
+ * transfer in its own transaction, while another thread keeps auditing
+ * the total. There is no mutex: conflicting transactions are restarted
+ * by the library. A transfer leaving an account below zero raises and
+ * the undo log puts the balances back.
+ *
+ * The audit always sees the same total, and the restarts are printed
+ * from the statistics at exit.
+ */
+#include <glib-2.0/glib.h>
+
+#include "libctrans.h"
+#include "libctrans_stm.h"
+
+#define N_ACCOUNTS   64
+#define N_THREADS    4
+#define N_TRANSFERS  100000
+#define INITIAL      1000
+
+static gsize accounts[N_ACCOUNTS];
+static volatile gint running;
+
+void transfer(Transaction* pTrans, guint from, guint to, gsize amount);
+gpointer run_transfers(gpointer data);
+gpointer run_audits(gpointer data);
+
+void exception_captured(Transaction* pTrans);
+void transaction_start (Transaction* pTrans);
+void transaction_stop  (Transaction* pTrans);
+
+void
+transfer(Transaction* pTrans, guint from, guint to, gsize amount)
+{
+    gsize balance = ctrans_stm_read(pTrans, &accounts[from]);
+    ctrans_stm_write(pTrans, &accounts[from], balance - amount);
+    ctrans_stm_write(pTrans, &accounts[to], ctrans_stm_read(pTrans, &accounts[to]) + amount);
+    if (balance < amount)
+      {
+        ctrans_raise_sender_exception(pTrans, INVALID_ARGUMENT | 2000001,
+            "not enough money", "transfer cancelled");
+      }
+}
+
+gpointer
+run_transfers(gpointer data)
+{
+    GRand* rand = g_rand_new_with_seed(GPOINTER_TO_UINT(data));
+    int idx;
+    for (idx = 0; idx < N_TRANSFERS; idx++)
+      {
+        guint from   = g_rand_int_range(rand, 0, N_ACCOUNTS);
+        guint to     = g_rand_int_range(rand, 0, N_ACCOUNTS);
+        gsize amount = g_rand_int_range(rand, 1, 300);
+                    Transaction* Trans1;
+                    NEWTRANSACTION(Trans1, transaction_start, transaction_stop, exception_captured,"transfer");
+        transfer(Trans1, from, to, amount);
+                    ENDTRANSACTION(Trans1);
+      }
+    g_rand_free(rand);
+    return NULL;
+}
+
+gpointer
+run_audits(gpointer data)
+{
+    volatile int audits = 0, wrong = 0; // kept across the longjmp of the restarts and of the commit
+    while (g_atomic_int_get(&running))
+      {
+        volatile gsize total; // kept across the longjmp of the restarts and of the commit
+        int idx;
+                    Transaction* Audit;
+                    NEWTRANSACTION(Audit, transaction_start, transaction_stop, exception_captured,"audit");
+        total = 0; // the body runs again after a restart
+        for (idx = 0; idx < N_ACCOUNTS; idx++) total += ctrans_stm_read(Audit, &accounts[idx]);
+                    ENDTRANSACTION(Audit);
+        if (total != N_ACCOUNTS * INITIAL) wrong++;
+        audits++;
+      }
+    printf("%d audits, %d wrong totals\n", audits, wrong);
+    return NULL;
+}
+
+int
+main(int nargs, char** args)
+{
+    GThread* threads[N_THREADS];
+    GThread* auditor;
+    CtransStats stats;
+    int idx;
+    for (idx = 0; idx < N_ACCOUNTS; idx++) accounts[idx] = INITIAL;
+    running = TRUE;
+    auditor = g_thread_new("audit", run_audits, NULL);
+    for (idx = 0; idx < N_THREADS; idx++)
+      {
+        threads[idx] = g_thread_new("transfer", run_transfers, GINT_TO_POINTER(idx + 1));
+      }
+    for (idx = 0; idx < N_THREADS; idx++) g_thread_join(threads[idx]);
+    g_atomic_int_set(&running, FALSE);
+    g_thread_join(auditor);
+    ctrans_stats_get_by_name("transfer", &stats);
+    printf("transfers: %" G_GUINT64_FORMAT " committed, %" G_GUINT64_FORMAT
+        " cancelled, %" G_GUINT64_FORMAT " restarts\n",
+        stats.committed, stats.rolled_back, stats.restarts);
+    ctrans_stats_get_by_name("audit", &stats);
+    printf("audits: %" G_GUINT64_FORMAT " restarts\n", stats.restarts);
+    return 0;
+}
+
+void
+exception_captured(Transaction* pTrans)
+{
+}
+
+void
+transaction_start(Transaction* pTrans)
+{
+}
+
+void
+transaction_stop(Transaction* pTrans)
+{
+}